@@ -0,0 +1,351 @@
+/*
+ * luaffi_bench：测量 LuaFFI 调用、编组与回调开销的微基准。
+ *
+ * 每个用例由一段 Lua 初始化代码与循环体组成，在同一 Lua 状态中计时执行，
+ * 结果以 JSON 输出到标准输出，便于逐次记录对比：
+ *
+ *   luaffi_bench [-n iterations] [-f filter] > result.json
+ *
+ * ns_per_call 已扣除空循环开销；allocs_per_call 统计进程内全部 malloc/calloc/realloc
+ * 调用（含 Lua 分配器），仅在 glibc 上可用，其他平台输出 null。
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+int luaopen_LuaFFI(lua_State* L);
+
+/* ---------- 分配计数（glibc：以可执行文件中的定义覆盖共享库中的 malloc） ---------- */
+static unsigned long __g_allocs;
+
+#if defined(__GLIBC__)
+#define HAVE_ALLOC_COUNT 1
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+
+void* malloc(size_t size) {
+    __atomic_add_fetch(&__g_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+void* calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&__g_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+void* realloc(void* p, size_t size) {
+    __atomic_add_fetch(&__g_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+#else
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+/* ---------- 被调用的 C 目标函数 ---------- */
+static long f1(long a) { return a; }
+static long f2(long a, long b) { return a + b; }
+static long f3(long a, long b, long c) { return a + b + c; }
+static long f4(long a, long b, long c, long d) { return a + b + c + d; }
+static long f5(long a, long b, long c, long d, long e) { return a + b + c + d + e; }
+static long f6(long a, long b, long c, long d, long e, long f) { return a + b + c + d + e + f; }
+static long f7(long a, long b, long c, long d, long e, long f, long g) { return a + b + c + d + e + f + g; }
+static long f8(long a, long b, long c, long d, long e, long f, long g, long h) { return a + b + c + d + e + f + g + h; }
+static double fd2(double a, double b) { return a + b; }
+
+/* 字符串参数与返回值 */
+static long zlen(const char* s) { return (long)strlen(s); }
+static long zbytes(const char* s, size_t n) { return s ? (long)n : -1; }
+static const char* zname(long i) { return (i & 1) ? "odd" : "even"; }
+
+/* 输出参数 */
+static long oparse(long v, double* out, long* used) { *out = v * 0.5; *used = v & 7; return 1; }
+
+static long vsum(long n, ...) {
+    va_list ap;
+    long s = 0;
+    va_start(ap, n);
+    for (long i = 0; i < n; i++) s += va_arg(ap, long);
+    va_end(ap);
+    return s;
+}
+
+/* 结构体按值传递/返回：Blob<N> 为 N 个 long */
+#define BLOB(N)                                                           \
+    typedef struct { long v[N]; } Blob##N;                                \
+    static long blob##N##_arg(Blob##N b) { return b.v[0] + b.v[N - 1]; } \
+    static Blob##N blob##N##_ret(Blob##N b) { b.v[0]++; return b; }
+BLOB(1) BLOB(8) BLOB(64) BLOB(512) BLOB(8192)
+
+/* 从 C 侧连续调用回调 n 次 */
+static long drive(int (*cb)(int, int), long n) {
+    long s = 0;
+    for (long i = 0; i < n; i++) s += cb((int)i, 1);
+    return s;
+}
+
+typedef struct { int (*cb)(int, int); long n; long sum; } DriveArg;
+
+static void* drive_thread(void* p) {
+    DriveArg* a = p;
+    a->sum = drive(a->cb, a->n);
+    return NULL;
+}
+
+/* nthreads 个线程各调用回调 n 次 */
+static long drive_threads(int (*cb)(int, int), int nthreads, long n) {
+    pthread_t tids[64];
+    DriveArg args[64];
+    if (nthreads > 64) nthreads = 64;
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        args[i] = (DriveArg){ cb, n, 0 };
+        if (pthread_create(&tids[i], NULL, drive_thread, &args[i]) != 0) break;
+        started++;
+    }
+    long s = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        s += args[i].sum;
+    }
+    return s;
+}
+
+/* ---------- 用例 ---------- */
+typedef struct {
+    const char* group;
+    const char* name;
+    const char* setup;      // 在循环外执行一次，可定义局部变量
+    const char* body;       // 循环体，i 为循环变量
+    long calls;             // 每次循环的调用次数（回调类用例为 C 侧调用次数）
+    long scale;             // 迭代次数除数，用于开销较大的用例
+} BenchCase;
+
+#define ARITY(n, sig, args) \
+    { "wrapNative", "arity" #n, "local f = ffi.wrapNative(C.f" #n ", '" sig "')", "f(" args ")", 1, 1 }
+#define VARIADIC(n, args) \
+    { "variadic", "vsum" #n, "local f = ffi.wrapNative(C.vsum, 'll...')", "f(" #n args ")", 1, 1 }
+#define STRUCTS(n, bytes, scale)                                                                    \
+    { "struct", "arg_view_" bytes,                                                                  \
+      "ffi.registerArray('Blob" #n "', 'l', " #n ") local v = ffi.view('Blob" #n "')"              \
+      " local f = ffi.wrapNative(C.blob" #n "_arg, 'l|Blob" #n "|')", "f(v)", 1, scale },          \
+    { "struct", "ret_view_" bytes,                                                                  \
+      "ffi.registerArray('Blob" #n "', 'l', " #n ") local v = ffi.view('Blob" #n "')"              \
+      " local f = ffi.wrapNative(C.blob" #n "_ret, '|Blob" #n "||Blob" #n "|'):returnViews()",     \
+      "f(v)", 1, scale }
+
+static const BenchCase __cases[] = {
+    /* 标量签名，元数 1-8（wrapNative 要求至少一个参数） */
+    ARITY(1, "ll", "i"),
+    ARITY(2, "lll", "i, 2"),
+    ARITY(3, "llll", "i, 2, 3"),
+    ARITY(4, "lllll", "i, 2, 3, 4"),
+    ARITY(5, "llllll", "i, 2, 3, 4, 5"),
+    ARITY(6, "lllllll", "i, 2, 3, 4, 5, 6"),
+    ARITY(7, "llllllll", "i, 2, 3, 4, 5, 6, 7"),
+    ARITY(8, "lllllllll", "i, 2, 3, 4, 5, 6, 7, 8"),
+    { "wrapNative", "double2", "local f = ffi.wrapNative(C.fd2, 'ddd')", "f(i, 0.5)", 1, 1 },
+    { "wrapNative", "batch64", "local f = ffi.wrapNative(C.f2, 'lll') local a, r = {}, {}"
+      " for k = 1, 64 do a[k] = {k, k} end", "f:batchInto(a, r)", 64, 16 },
+
+    /* 可变参数 */
+    VARIADIC(1, ", i"),
+    VARIADIC(4, ", i, 2, 3, 4"),
+    VARIADIC(8, ", i, 2, 3, 4, 5, 6, 7, 8"),
+    { "variadic", "vsum4_alternating", "local f = ffi.wrapNative(C.vsum, 'll...')",
+      "if i % 2 == 0 then f(4, i, 2, 3, 4) else f(2, i, 2) end", 1, 1 },
+
+    /* 字符串：z 传递/返回 const char*，Z 传递 (指针, 长度) */
+    { "string", "z_arg", "local f = ffi.wrapNative(C.zlen, 'lz') local s = 'some string'", "f(s)", 1, 1 },
+    { "string", "Z_arg", "local f = ffi.wrapNative(C.zbytes, 'lZ') local s = string.rep('x', 4096)", "f(s)", 1, 1 },
+    { "string", "z_ret", "local f = ffi.wrapNative(C.zname, 'zl')", "f(i)", 1, 1 },
+
+    /* 输出参数：&T 存储在参数帧中，对比以视图作为调用方缓冲区 */
+    { "outparam", "out2", "local f = ffi.wrapNative(C.oparse, 'll&d&l')", "f(i)", 1, 1 },
+    { "outparam", "view_buffers", "ffi.registerStruct('OutD', 'd') ffi.registerStruct('OutL', 'l')"
+      " local f = ffi.wrapNative(C.oparse, 'llpp') local d, u = ffi.view('OutD'), ffi.view('OutL')",
+      "f(i, d, u) local x, y = d[1], u[1]", 1, 1 },
+
+    /* 结构体按值传递与返回，8 B 到 64 KB */
+    { "struct", "arg_table_8B", "ffi.registerStruct('B1', 'l') local t = {1}"
+      " local f = ffi.wrapNative(C.blob1_arg, 'l|B1|')", "f(t)", 1, 1 },
+    { "struct", "arg_table_64B", "ffi.registerArray('Blob8', 'l', 8) local t = {1, 2, 3, 4, 5, 6, 7, 8}"
+      " local f = ffi.wrapNative(C.blob8_arg, 'l|Blob8|')", "f(t)", 1, 1 },
+    STRUCTS(1, "8B", 1),
+    STRUCTS(8, "64B", 1),
+    STRUCTS(64, "512B", 1),
+    STRUCTS(512, "4KB", 4),
+    STRUCTS(8192, "64KB", 64),
+
+    /* 从 C 调用 wrapLua 回调 */
+    { "wrapLua", "drive1000", "function __bench_cb(a, b) return a + b end"
+      " local cb = ffi.wrapLua('__bench_cb', 'iii') local d = ffi.wrapNative(C.drive, 'lpl')",
+      "d(cb, 1000)", 1000, 1000 },
+    { "wrapLua", "qsort64", "ffi.registerStruct('BenchInt', 'i') local get = ffi.accessor('BenchInt', 1)"
+      " function __bench_cmp(pa, pb) local a, b = get(pa), get(pb) return a < b and -1 or (a > b and 1 or 0) end"
+      " ffi.registerArray('Ints64', 'i', 64) local v = ffi.view('Ints64')"
+      " local cmp = ffi.wrapLua('__bench_cmp', 'ipp') local qsort = ffi.wrapNative(C.qsort_ints, 'vpp')",
+      "for k = 1, 64 do v[k] = (k * 7919 + i) % 64 end qsort(v, cmp)", 1, 256 },
+
+    /* wrapLuaMT 回调：所属线程与外部线程 */
+    { "wrapLuaMT", "drive1000", "function __bench_mt(a, b) return a + b end"
+      " local cb = ffi.wrapLuaMT('__bench_mt', 'iii') local d = ffi.wrapNative(C.drive, 'lpl')",
+      "d(cb, 1000)", 1000, 1000 },
+    { "wrapLuaMT", "drive1000x4threads", "function __bench_mt(a, b) return a + b end"
+      " local cb = ffi.wrapLuaMT('__bench_mt', 'iii') local d = ffi.wrapNative(C.drive_threads, 'lpil')",
+      "d(cb, 4, 1000)", 4000, 4000 },
+
+    /* 签名解析与结构体注册 */
+    { "parse", "signature_interned", "", "ffi.signature('ipd|Bench|')", 1, 1 },
+    { "parse", "signature_cold", "local n = 0",
+      "n = n + 1 ffi.signature('iiiiddddpppp' .. string.rep('l', n % 32))", 1, 4 },
+    { "parse", "registerStruct8", "", "ffi.registerStruct('Bench', 'iiddppCC')", 1, 4 },
+    { "parse", "registerStruct8_named", "local names = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h'}",
+      "ffi.registerStruct('Bench', 'iiddppCC', names)", 1, 4 },
+};
+
+/* qsort 的 64 个 int 版本，比较函数由 Lua 提供 */
+static void qsort_ints(int* v, int (*cmp)(const int*, const int*)) {
+    qsort(v, 64, sizeof(int), (int (*)(const void*, const void*))cmp);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* 编译用例，栈顶留下循环函数 function(n) */
+static int load_case(lua_State* L, const BenchCase* c) {
+    char* src = NULL;
+    size_t len = 0;
+    FILE* f = open_memstream(&src, &len);
+    if (!f) return 0;
+    fprintf(f, "local ffi, C = LuaFFI, __bench_c %s\nreturn function(n) for i = 1, n do %s end end",
+            c->setup, c->body);
+    fclose(f);
+    int ok = luaL_loadbuffer(L, src, len, c->name) == LUA_OK && lua_pcall(L, 0, 1, 0) == LUA_OK;
+    free(src);
+    return ok;
+}
+
+/* 运行栈顶的循环函数 n 次，返回耗时（纳秒），*allocs 为期间的分配次数 */
+static double run_loop(lua_State* L, long n, unsigned long* allocs, const char** err) {
+    lua_pushvalue(L, -1);
+    lua_pushinteger(L, n);
+    unsigned long a0 = __atomic_load_n(&__g_allocs, __ATOMIC_RELAXED);
+    double t0 = now_ns();
+    int status = lua_pcall(L, 1, 0, 0);
+    double t1 = now_ns();
+    *allocs = __atomic_load_n(&__g_allocs, __ATOMIC_RELAXED) - a0;
+    if (status != LUA_OK) {
+        *err = lua_tostring(L, -1);
+        return -1;
+    }
+    return t1 - t0;
+}
+
+static void json_string(const char* s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", *s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+static void register_targets(lua_State* L) {
+    lua_newtable(L);
+#define REG(fn) lua_pushlightuserdata(L, (void*)fn); lua_setfield(L, -2, #fn)
+    REG(f1); REG(f2); REG(f3); REG(f4); REG(f5); REG(f6); REG(f7); REG(f8); REG(fd2);
+    REG(zlen); REG(zbytes); REG(zname); REG(oparse);
+    REG(vsum); REG(drive); REG(drive_threads); REG(qsort_ints);
+    REG(blob1_arg); REG(blob1_ret); REG(blob8_arg); REG(blob8_ret); REG(blob64_arg); REG(blob64_ret);
+    REG(blob512_arg); REG(blob512_ret); REG(blob8192_arg); REG(blob8192_ret);
+#undef REG
+    lua_setglobal(L, "__bench_c");
+}
+
+int main(int argc, char** argv) {
+    long iterations = 1000000;
+    const char* filter = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) iterations = atol(argv[++i]);
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc) filter = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [-n iterations] [-f filter]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations < 1) iterations = 1;
+
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    luaL_requiref(L, "LuaFFI", luaopen_LuaFFI, 1);
+    lua_pop(L, 1);
+    register_targets(L);
+    if (luaL_dostring(L, "LuaFFI.registerStruct('Bench', 'iiddppCC')") != LUA_OK) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    /* 空循环基线 */
+    static const BenchCase empty = { "baseline", "empty", "", "", 1, 1 };
+    unsigned long allocs;
+    const char* err = NULL;
+    load_case(L, &empty);
+    run_loop(L, iterations / 10, &allocs, &err);
+    double empty_ns = run_loop(L, iterations, &allocs, &err) / (double)iterations;
+    lua_pop(L, 1);
+
+    printf("{\n  \"benchmark\": \"luaffi\",\n  \"iterations\": %ld,\n", iterations);
+    printf("  \"alloc_counting\": %s,\n  \"empty_loop_ns\": %.3f,\n  \"results\": [",
+           HAVE_ALLOC_COUNT ? "true" : "false", empty_ns);
+
+    int first = 1;
+    for (size_t k = 0; k < sizeof(__cases) / sizeof(__cases[0]); k++) {
+        const BenchCase* c = &__cases[k];
+        if (filter && !strstr(c->group, filter) && !strstr(c->name, filter)) continue;
+
+        printf("%s\n    {\"group\": ", first ? "" : ",");
+        first = 0;
+        json_string(c->group);
+        printf(", \"name\": ");
+        json_string(c->name);
+
+        long n = iterations / c->scale;
+        if (n < 1) n = 1;
+        double ns = -1;
+        err = NULL;
+        if (!load_case(L, c)) {
+            err = lua_tostring(L, -1);
+        } else {
+            run_loop(L, n / 10 + 1, &allocs, &err);         // 预热：填充缓存与暂存区
+            if (!err) ns = run_loop(L, n, &allocs, &err);
+        }
+        if (err) {
+            printf(", \"error\": ");
+            json_string(err);
+            printf("}");
+        } else {
+            double calls = (double)n * (double)c->calls;
+            printf(", \"iterations\": %ld, \"calls\": %.0f, \"ns_per_call\": %.3f, \"allocs_per_call\": ",
+                   n, calls, (ns - empty_ns * (double)n) / calls);
+            if (HAVE_ALLOC_COUNT) printf("%.4f}", (double)allocs / calls);
+            else printf("null}");
+        }
+        lua_settop(L, 0);
+        lua_gc(L, LUA_GCCOLLECT, 0);
+    }
+    printf("\n  ]\n}\n");
+
+    lua_close(L);
+    return 0;
+}
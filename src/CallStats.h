@@ -0,0 +1,126 @@
+#ifndef LUAFFI_CALLSTATS_H
+#define LUAFFI_CALLSTATS_H
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ---------- 调用统计（LuaFFI.enableStats 开启后按绑定惰性创建） ----------
+ * 延迟直方图为对数-线性分桶（HDR 风格）：每个 2 的幂区间再均分 16 个子桶，
+ * 相对误差不超过 1/16；超过 2^40 ns 的值计入最后一个区间。 */
+#define STATS_SUB_BITS  4
+#define STATS_SUB       (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP   40
+#define STATS_BUCKETS   ((STATS_MAX_EXP - STATS_SUB_BITS + 2) * STATS_SUB)
+
+enum { STATS_NATIVE, STATS_LUA, STATS_LUA_MT };
+
+typedef struct CallStats {
+    char*       name;           // 绑定标识（签名与函数名/地址）
+    int         kind;           // STATS_*
+    uint64_t    count;          // 调用次数
+    uint64_t    total_ns;       // 累计耗时
+    uint64_t    max_ns;         // 单次最大耗时
+    uint64_t    marshal_ns;     // 参数与返回值转换耗时
+    uint64_t    target_ns;      // 目标函数（C 函数或 Lua 函数）内耗时
+    struct CallStats* prev;
+    struct CallStats* next;
+    uint64_t    hist[STATS_BUCKETS];
+} CallStats;
+
+static int __g_stats_enabled = 0;
+static CallStats* __g_stats_head = NULL;
+static pthread_mutex_t __g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int stats_enabled(void) {
+    return __builtin_expect(__atomic_load_n(&__g_stats_enabled, __ATOMIC_RELAXED), 0);
+}
+
+static inline uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline int stats_bucket(uint64_t v) {
+    if (v < STATS_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e > STATS_MAX_EXP) return STATS_BUCKETS - 1;
+    return (e - STATS_SUB_BITS + 1) * STATS_SUB + (int)((v >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/* 桶的下界（纳秒） */
+static inline uint64_t stats_bucket_low(int b) {
+    if (b < STATS_SUB) return (uint64_t)b;
+    int e = b / STATS_SUB + STATS_SUB_BITS - 1;
+    return (uint64_t)(STATS_SUB + b % STATS_SUB) << (e - STATS_SUB_BITS);
+}
+
+/* 桶的上界（不含） */
+static inline uint64_t stats_bucket_high(int b) {
+    if (b < STATS_SUB) return (uint64_t)b + 1;
+    int e = b / STATS_SUB + STATS_SUB_BITS - 1;
+    return stats_bucket_low(b) + ((uint64_t)1 << (e - STATS_SUB_BITS));
+}
+
+/* 创建并登记统计项，失败返回 NULL（不影响调用本身） */
+static CallStats* stats_new(int kind, const char* name) {
+    CallStats* st = calloc(1, sizeof(CallStats));
+    if (!st) return NULL;
+    st->name = strdup(name);
+    if (!st->name) { free(st); return NULL; }
+    st->kind = kind;
+    pthread_mutex_lock(&__g_stats_lock);
+    st->next = __g_stats_head;
+    if (__g_stats_head) __g_stats_head->prev = st;
+    __g_stats_head = st;
+    pthread_mutex_unlock(&__g_stats_lock);
+    return st;
+}
+
+/* 绑定释放时注销统计项 */
+static void stats_free(CallStats* st) {
+    if (!st) return;
+    pthread_mutex_lock(&__g_stats_lock);
+    if (st->prev) st->prev->next = st->next;
+    else __g_stats_head = st->next;
+    if (st->next) st->next->prev = st->prev;
+    pthread_mutex_unlock(&__g_stats_lock);
+    free(st->name);
+    free(st);
+}
+
+/* 惰性安装：多个线程同时创建时只保留一个 */
+static inline CallStats* stats_install(CallStats** slot, CallStats* st) {
+    CallStats* expected = NULL;
+    if (!st || __atomic_compare_exchange_n(slot, &expected, st, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return st;
+    stats_free(st);
+    return expected;
+}
+
+/* 记录一次调用：t0 开始，t1 进入目标函数，t2 目标函数返回，t3 结束 */
+static inline void stats_record(CallStats* st, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3) {
+    uint64_t total = t3 - t0;
+    __atomic_add_fetch(&st->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->total_ns, total, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->marshal_ns, (t1 - t0) + (t3 - t2), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->target_ns, t2 - t1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->hist[stats_bucket(total)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+    while (total > max &&
+           !__atomic_compare_exchange_n(&st->max_ns, &max, total, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void stats_reset(CallStats* st) {
+    __atomic_store_n(&st->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->total_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->max_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->marshal_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->target_ns, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < STATS_BUCKETS; i++)
+        __atomic_store_n(&st->hist[i], 0, __ATOMIC_RELAXED);
+}
+
+#endif
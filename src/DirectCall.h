@@ -0,0 +1,111 @@
+#ifndef LUAFFI_DIRECTCALL_H
+#define LUAFFI_DIRECTCALL_H
+#include "ffi.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include <stddef.h>
+
+/*
+ * 常见标量签名的直接调用桩：将 func_ptr 转换为确切的 C 原型后直接调用，
+ * 跳过 libffi。仅覆盖"参数同类型"的签名（如 ii、iii、dd、pp、vp），
+ * 参数类型限于 int/long/pointer/double，返回值另可为 void。
+ * 参数从 Lua 栈 base 位置开始读取，返回压栈的值个数。
+ */
+typedef int (*DirectThunk)(lua_State* L, void* fn, int base);
+
+#define DT_MAX_ARGS 6
+
+/* ---------- 类型编码 -> C 类型 ---------- */
+#define DT_CTYPE_v void
+#define DT_CTYPE_i int
+#define DT_CTYPE_l long
+#define DT_CTYPE_p void*
+#define DT_CTYPE_d double
+
+/* ---------- 从 Lua 栈读取参数 ---------- */
+/* 指针参数与 ffi_call 路径一致，由 to_c_pointer（定义于 LuaFFI.c）解包视图等句柄 */
+static void to_c_pointer(lua_State* L, int idx, void* out);
+
+static inline void* dt_get_pointer(lua_State* L, int idx) {
+    void* p;
+    to_c_pointer(L, idx, &p);
+    return p;
+}
+
+#define DT_GET_i(L, idx) ((int)luaL_checkinteger(L, idx))
+#define DT_GET_l(L, idx) ((long)luaL_checkinteger(L, idx))
+#define DT_GET_p(L, idx) dt_get_pointer(L, idx)
+#define DT_GET_d(L, idx) luaL_checknumber(L, idx)
+
+/* ---------- 压入返回值，表达式结果为返回值个数 ---------- */
+#define DT_RET_v(L, expr) ((expr), 0)
+#define DT_RET_i(L, expr) (lua_pushinteger(L, (expr)), 1)
+#define DT_RET_l(L, expr) (lua_pushinteger(L, (expr)), 1)
+#define DT_RET_p(L, expr) (lua_pushlightuserdata(L, (expr)), 1)
+#define DT_RET_d(L, expr) (lua_pushnumber(L, (expr)), 1)
+
+/* ---------- 按参数个数展开形参类型与实参 ---------- */
+#define DT_PARAMS_1(k) DT_CTYPE_##k
+#define DT_PARAMS_2(k) DT_PARAMS_1(k), DT_CTYPE_##k
+#define DT_PARAMS_3(k) DT_PARAMS_2(k), DT_CTYPE_##k
+#define DT_PARAMS_4(k) DT_PARAMS_3(k), DT_CTYPE_##k
+#define DT_PARAMS_5(k) DT_PARAMS_4(k), DT_CTYPE_##k
+#define DT_PARAMS_6(k) DT_PARAMS_5(k), DT_CTYPE_##k
+
+#define DT_ARGS_1(k) DT_GET_##k(L, base)
+#define DT_ARGS_2(k) DT_ARGS_1(k), DT_GET_##k(L, base + 1)
+#define DT_ARGS_3(k) DT_ARGS_2(k), DT_GET_##k(L, base + 2)
+#define DT_ARGS_4(k) DT_ARGS_3(k), DT_GET_##k(L, base + 3)
+#define DT_ARGS_5(k) DT_ARGS_4(k), DT_GET_##k(L, base + 4)
+#define DT_ARGS_6(k) DT_ARGS_5(k), DT_GET_##k(L, base + 5)
+
+#define DT_DEFINE(r, k, n) \
+    static int __dt_##r##k##n(lua_State* L, void* fn, int base) { \
+        return DT_RET_##r(L, ((DT_CTYPE_##r (*)(DT_PARAMS_##n(k)))fn)(DT_ARGS_##n(k))); \
+    }
+
+#define DT_DEFINE_ARITIES(r, k) \
+    DT_DEFINE(r, k, 1) DT_DEFINE(r, k, 2) DT_DEFINE(r, k, 3) \
+    DT_DEFINE(r, k, 4) DT_DEFINE(r, k, 5) DT_DEFINE(r, k, 6)
+
+#define DT_DEFINE_KINDS(r) \
+    DT_DEFINE_ARITIES(r, i) DT_DEFINE_ARITIES(r, l) \
+    DT_DEFINE_ARITIES(r, p) DT_DEFINE_ARITIES(r, d)
+
+DT_DEFINE_KINDS(v)
+DT_DEFINE_KINDS(i)
+DT_DEFINE_KINDS(l)
+DT_DEFINE_KINDS(p)
+DT_DEFINE_KINDS(d)
+
+/* ---------- 桩表：[返回类型][参数类型][参数个数] ---------- */
+#define DT_ROW(r, k) { NULL, __dt_##r##k##1, __dt_##r##k##2, __dt_##r##k##3, \
+                       __dt_##r##k##4, __dt_##r##k##5, __dt_##r##k##6 }
+#define DT_KINDS(r) { DT_ROW(r, i), DT_ROW(r, l), DT_ROW(r, p), DT_ROW(r, d) }
+
+static const DirectThunk __direct_thunks[5][4][DT_MAX_ARGS + 1] = {
+    DT_KINDS(v), DT_KINDS(i), DT_KINDS(l), DT_KINDS(p), DT_KINDS(d)
+};
+
+/* v/i/l/p/d -> 0..4，其余类型返回 -1 */
+static inline int direct_kind(ffi_type* type) {
+    if (type == &ffi_type_void)    return 0;
+    if (type == &ffi_type_sint)    return 1;
+    if (type == &ffi_type_slong)   return 2;
+    if (type == &ffi_type_pointer) return 3;
+    if (type == &ffi_type_double)  return 4;
+    return -1;
+}
+
+/* 选择直接调用桩，不满足条件时返回 NULL（回退到 ffi_call） */
+static inline DirectThunk select_direct_thunk(ffi_type* ret, ffi_type** args, int nargs) {
+    if (nargs < 1 || nargs > DT_MAX_ARGS) return NULL;
+    int rk = direct_kind(ret);
+    int ak = direct_kind(args[0]);
+    if (rk < 0 || ak <= 0) return NULL;
+    for (int i = 1; i < nargs; i++)
+        if (args[i] != args[0]) return NULL;
+    return __direct_thunks[rk][ak - 1][nargs];
+}
+
+#endif
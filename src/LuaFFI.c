@@ -2,6 +2,10 @@
 #include "lua.h"
 #include "lauxlib.h"
 #include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "LuaFFI.h"
 
 /* ---------- container_of 宏（从 ffi_type* 获得 Structure*） ---------- */
@@ -16,6 +20,89 @@ static inline Structure* get_structure(ffi_type* type) {
     return container_of(type, Structure, type);
 }
 
+/* z / Z 只用于函数签名，不能作为结构体字段或数组元素 */
+static inline int is_string_type(ffi_type* type) {
+    return type == &__ffi_type_string || type == &__ffi_type_lstring || type == &__ffi_type_lstring_len;
+}
+
+/* & / * 输出参数标记同样只用于函数签名 */
+static inline int is_out_marker(ffi_type* type) {
+    return type == &__ffi_type_out || type == &__ffi_type_inout;
+}
+
+/* ---------- 字段 i（0 起）的类型与偏移，数组类型按元素间距计算 ---------- */
+static inline ffi_type* struct_field_type(const Structure* st, int i) {
+    return st->elem ? st->elem : st->type.elements[i];
+}
+
+static inline size_t struct_field_offset(const Structure* st, int i) {
+    return st->elem ? (size_t)i * st->stride : st->offsets[i];
+}
+
+/* ---------- 字段名查找：注册时建立的开放寻址表，返回 0 起序号，未找到返回 -1 ---------- */
+static int struct_field_find(const Structure* st, const char* name, size_t len) {
+    if (!st->field_slots) return -1;
+    for (size_t i = hash_str_n(name, len) & st->field_mask; st->field_slots[i]; i = (i + 1) & st->field_mask) {
+        const char* fname = st->field_names[st->field_slots[i] - 1];
+        if (strncmp(fname, name, len) == 0 && fname[len] == '\0')
+            return st->field_slots[i] - 1;
+    }
+    return -1;
+}
+
+/* 按 names 表建立字段名与查找表，失败返回错误信息 */
+static const char* struct_set_field_names(lua_State* L, Structure* st, int idx) {
+    int n = (int)lua_rawlen(L, idx);
+    if (n != st->nfields) return "field name count does not match the signature";
+
+    size_t bytes = n * sizeof(char*);
+    for (int i = 1; i <= n; i++) {
+        if (lua_rawgeti(L, idx, i) != LUA_TSTRING) {
+            lua_pop(L, 1);
+            return "field names must be strings";
+        }
+        bytes += lua_rawlen(L, -1) + 1;
+        lua_pop(L, 1);
+    }
+
+    size_t cap = 4;
+    while (cap < (size_t)n * 2) cap <<= 1;
+    char** names = malloc(bytes);
+    int* slots = calloc(cap, sizeof(int));
+    if (!names || !slots) {
+        free(names);
+        free(slots);
+        return "failed to alloc mem";
+    }
+
+    char* text = (char*)(names + n);
+    for (int i = 0; i < n; i++) {
+        size_t len;
+        lua_rawgeti(L, idx, i + 1);
+        const char* name = lua_tolstring(L, -1, &len);
+        memcpy(text, name, len + 1);
+        names[i] = text;
+        text += len + 1;
+        lua_pop(L, 1);
+
+        size_t slot = hash_str_n(name, len) & (cap - 1);
+        while (slots[slot]) {
+            if (strcmp(names[slots[slot] - 1], names[i]) == 0) {
+                free(names);
+                free(slots);
+                return "duplicate field name";
+            }
+            slot = (slot + 1) & (cap - 1);
+        }
+        slots[slot] = i + 1;
+    }
+
+    st->field_names = names;
+    st->field_slots = slots;
+    st->field_mask = cap - 1;
+    return NULL;
+}
+
 /* 参数数量检查 */
 #define LUA_ARGC_ASSERT(L, num) \
     do { \
@@ -53,7 +140,7 @@ static inline ffi_type** parse_string_fsm(const char* str) {
     }
 
     size_t str_len = strlen(str);
-    ffi_type** result = malloc((str_len + 1) * sizeof(ffi_type*));
+    ffi_type** result = malloc((2 * str_len + 1) * sizeof(ffi_type*));    // Z 展开为两项
     if (!result) return NULL;
 
     size_t count = 0;
@@ -68,6 +155,19 @@ static inline ffi_type** parse_string_fsm(const char* str) {
                 p++;
                 continue;
             }
+            /* Z：字符串指针与长度两个参数 */
+            if (*p == 'Z') {
+                result[count++] = &__ffi_type_lstring;
+                result[count++] = &__ffi_type_lstring_len;
+                p++;
+                continue;
+            }
+            /* 输出参数标记：修饰随后的类型 */
+            if (*p == '&' || *p == '*') {
+                result[count++] = *p == '&' ? &__ffi_type_out : &__ffi_type_inout;
+                p++;
+                continue;
+            }
             /* 进入管道状态 */
             if (*p == '|') {
                 key_start = p + 1;
@@ -86,28 +186,8 @@ static inline ffi_type** parse_string_fsm(const char* str) {
             if (*p == '|') {
                 size_t key_len = p - key_start;
                 if (key_len > 0) {
-                    char stack_buf[256];
-                    char* key = key_len < sizeof(stack_buf) ? stack_buf : malloc(key_len + 1);
-                    if (!key && key_len >= sizeof(stack_buf)) {
-                        free(result);
-                        return NULL;
-                    }
-                    memcpy(key, key_start, key_len);
-                    key[key_len] = '\0';
-
-                    size_t idx = hash_str(key) % __g_struct_map->size;
-                    Node* node = __g_struct_map->buckets[idx];
-                    while (node) {
-                        if (node->key[0] == key[0] &&
-                            strlen(node->key) == key_len &&
-                            memcmp(node->key, key, key_len) == 0) {
-                            result[count++] = &node->type.type;
-                            break;
-                        }
-                        node = node->next;
-                    }
-
-                    if (key_len >= sizeof(stack_buf)) free(key);
+                    Structure* st = structmap_acquire(key_start, key_len);    // 结果数组持有引用
+                    if (st) result[count++] = &st->type;
                 }
                 key_start = NULL;
                 p++;
@@ -120,7 +200,7 @@ static inline ffi_type** parse_string_fsm(const char* str) {
     result[count] = NULL;
 
     /* 压缩数组（可选） */
-    if (count + 1 < str_len + 1) {
+    if (count < 2 * str_len) {
         ffi_type** shrunk = realloc(result, (count + 1) * sizeof(ffi_type*));
         if (shrunk) result = shrunk;
     }
@@ -128,6 +208,279 @@ static inline ffi_type** parse_string_fsm(const char* str) {
     return result;
 }
 
+/* 释放 parse_string_fsm 的结果及其持有的结构体引用 */
+static void types_free(ffi_type** types) {
+    if (!types) return;
+    for (ffi_type** t = types; *t; t++) type_release(*t);
+    free(types);
+}
+
+static int plan_compile(MarshalPlan* plan, ffi_type** types, int ntypes);
+static int plan_compile_outputs(MarshalPlan* out, const MarshalPlan* args);
+static void plan_free(MarshalPlan* plan);
+
+/* ---------- 签名驻留表：签名文本 -> Signature ---------- */
+#define SIGN_TABLE_SIZE 1024
+
+static Signature* __g_sign_table[SIGN_TABLE_SIZE];
+static pthread_mutex_t __g_sign_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void signature_retain(Signature* sig) {
+    __atomic_add_fetch(&sig->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline void signature_release(Signature* sig) {
+    if (sig && __atomic_sub_fetch(&sig->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        plan_free(&sig->args_plan);
+        plan_free(&sig->ret_plan);
+        plan_free(&sig->out_plan);
+        if (sig->arg_types != sig->types + 1) free(sig->arg_types);
+        types_free(sig->types);
+        free(sig->text);
+        free(sig);
+    }
+}
+
+/* 解析并预处理签名（不入表），失败时 *err 指向错误信息 */
+static Signature* signature_compile(const char* text, size_t hash, const char** err) {
+    ffi_type** types = parse_string_fsm(text);
+    if (!types) { *err = "out of memory"; return NULL; }
+    if (!types[0]) {
+        types_free(types);
+        *err = "invalid signature (missing return type)";
+        return NULL;
+    }
+    if (types[0] == &__ffi_type_lstring) {
+        types_free(types);
+        *err = "Z cannot be a return type (use z)";
+        return NULL;
+    }
+    if (is_out_marker(types[0])) {
+        types_free(types);
+        *err = "& / * can only mark arguments";
+        return NULL;
+    }
+
+    /* 分离固定参数与可变参数标记；输出参数（标记加被指向类型两项）计为一个 C 参数 */
+    int nfixed = 0;
+    int nraw = 0;               // 固定参数在 types 中占的项数
+    int nout = 0;
+    int has_var = 0;
+    ffi_type* last_fixed = NULL;
+    int i;
+    for (i = 1; types[i] != NULL; i++) {
+        if (types[i] == (ffi_type*)VARIABLE) {
+            has_var = 1;
+            i++;  // 跳过标记
+            break;
+        }
+        nfixed++;
+        nraw++;
+        last_fixed = types[i];
+        if (is_out_marker(types[i])) {
+            ffi_type* t = types[i + 1];
+            if (!t || t == (ffi_type*)VARIABLE || t->type == FFI_TYPE_VOID || is_out_marker(t) ||
+                t == &__ffi_type_lstring || t == &__ffi_type_lstring_len) {
+                types_free(types);
+                *err = "& / * must be followed by a non-void type other than Z";
+                return NULL;
+            }
+            nraw++;
+            nout++;
+            i++;
+        }
+    }
+    /* 检查标记后是否还有多余参数（违反 ... 语义） */
+    if (has_var && types[i] != NULL) {
+        types_free(types);
+        *err = "Variadic marker '...' must be at the end of signature";
+        return NULL;
+    }
+    if (has_var && nfixed == 0) {
+        types_free(types);
+        *err = "Variadic function must have at least one fixed argument";
+        return NULL;
+    }
+    if (has_var && last_fixed == &__ffi_type_lstring_len) {
+        types_free(types);
+        *err = "Variadic function cannot have Z as the last fixed argument";
+        return NULL;
+    }
+    if (has_var && nout) {
+        types_free(types);
+        *err = "out-parameters (& / *) are not supported in variadic signatures";
+        return NULL;
+    }
+
+    /* 含输出参数时另建 C 参数类型数组，输出参数按指针传递 */
+    ffi_type** arg_types = types + 1;
+    if (nout) {
+        arg_types = malloc((nfixed + 1) * sizeof(ffi_type*));
+        if (!arg_types) {
+            types_free(types);
+            *err = "out of memory";
+            return NULL;
+        }
+        for (int r = 1, k = 0; k < nfixed; r++, k++) {
+            if (is_out_marker(types[r])) {
+                arg_types[k] = &ffi_type_pointer;
+                r++;                    // 跳过被指向的类型
+            } else {
+                arg_types[k] = types[r];
+            }
+        }
+        arg_types[nfixed] = NULL;
+    }
+
+    /* 计算可变参数提升类型 */
+    ffi_type* var_promoted = NULL;
+    if (has_var) {
+        if (last_fixed == &ffi_type_float)
+            var_promoted = &ffi_type_double;
+        else if (last_fixed == &ffi_type_schar || last_fixed == &ffi_type_sshort)
+            var_promoted = &ffi_type_sint;      // 有符号小整数提升为 int
+        else if (last_fixed == &ffi_type_uchar || last_fixed == &ffi_type_ushort)
+            var_promoted = &ffi_type_uint;      // 无符号小整数提升为 unsigned int
+        else
+            var_promoted = last_fixed;          // 其他类型（double, pointer, struct...）保持不变
+    }
+
+    Signature* sig = malloc(sizeof(Signature));
+    char* copy = strdup(text);
+    if (!sig || !copy) {
+        free(sig);
+        free(copy);
+        if (nout) free(arg_types);
+        types_free(types);
+        *err = "out of memory";
+        return NULL;
+    }
+    sig->text         = copy;
+    sig->hash         = hash;
+    sig->types        = types;
+    sig->ret_type     = types[0];
+    sig->arg_types    = arg_types;
+    sig->nfixed       = nfixed;
+    sig->is_variadic  = has_var;
+    sig->var_promoted = var_promoted;
+    sig->refcount     = 1;
+    sig->next         = NULL;
+    memset(&sig->args_plan, 0, sizeof(MarshalPlan));
+    memset(&sig->ret_plan, 0, sizeof(MarshalPlan));
+    memset(&sig->out_plan, 0, sizeof(MarshalPlan));
+
+    /* 非可变参数签名：预先生成 cif，wrapNative/wrapLua/wrapLuaMT 共用 */
+    if (!has_var) {
+        ffi_status status = ffi_prep_cif(&sig->cif, FFI_DEFAULT_ABI, nfixed,
+                                         sig->ret_type, sig->arg_types);
+        if (status != FFI_OK) {
+            signature_release(sig);
+            *err = "ffi_prep_cif failed";
+            return NULL;
+        }
+        /* 输出参数需在调用后读取，不走直接调用桩 */
+        sig->thunk = nout ? NULL : select_direct_thunk(sig->ret_type, sig->arg_types, nfixed);
+    } else {
+        sig->thunk = NULL;
+    }
+
+    /* 预编译参数、返回值与输出参数的编组计划（参数计划按含标记的原始类型编译） */
+    int ret_void = sig->ret_type->type == FFI_TYPE_VOID;
+    if (!plan_compile(&sig->args_plan, types + 1, nraw) ||
+        !plan_compile(&sig->ret_plan, &sig->ret_type, ret_void ? 0 : 1) ||
+        (nout && !plan_compile_outputs(&sig->out_plan, &sig->args_plan))) {
+        signature_release(sig);
+        *err = "unsupported type in signature";
+        return NULL;
+    }
+    sig->ret_size = sig->ret_type->size < sizeof(ffi_arg) ? sizeof(ffi_arg) : sig->ret_type->size;
+    return sig;
+}
+
+/* 查找或创建签名句柄，返回值由调用者持有一个引用 */
+static Signature* signature_intern(const char* text, const char** err) {
+    size_t h = hash_str(text);
+    size_t idx = h % SIGN_TABLE_SIZE;
+
+    pthread_mutex_lock(&__g_sign_mutex);
+    for (Signature* s = __g_sign_table[idx]; s; s = s->next) {
+        if (s->hash == h && strcmp(s->text, text) == 0) {
+            signature_retain(s);
+            pthread_mutex_unlock(&__g_sign_mutex);
+            return s;
+        }
+    }
+
+    Signature* sig = signature_compile(text, h, err);
+    if (sig) {
+        signature_retain(sig);          // 驻留表持有一个引用
+        sig->next = __g_sign_table[idx];
+        __g_sign_table[idx] = sig;
+    }
+    pthread_mutex_unlock(&__g_sign_mutex);
+    return sig;
+}
+
+/* 结构体注册表变化后清空驻留表（已有句柄由引用计数维持） */
+static void signature_table_clear(void) {
+    pthread_mutex_lock(&__g_sign_mutex);
+    for (size_t i = 0; i < SIGN_TABLE_SIZE; i++) {
+        Signature* s = __g_sign_table[i];
+        __g_sign_table[i] = NULL;
+        while (s) {
+            Signature* next = s->next;
+            s->next = NULL;
+            signature_release(s);
+            s = next;
+        }
+    }
+    pthread_mutex_unlock(&__g_sign_mutex);
+}
+
+/* 从 Lua 栈获取签名：接受字符串或 LuaFFI.signature 返回的句柄 */
+static Signature* check_signature(lua_State* L, int idx) {
+    Signature** ud = (Signature**)luaL_testudata(L, idx, "Signature");
+    if (ud) {
+        if (!*ud) luaL_error(L, "LuaFFI: Signature is released");
+        signature_retain(*ud);
+        return *ud;
+    }
+    if (lua_type(L, idx) != LUA_TSTRING)
+        luaL_error(L, "LuaFFI: argument %d needs a signature string or Signature", idx);
+
+    const char* err = NULL;
+    Signature* sig = signature_intern(lua_tostring(L, idx), &err);
+    if (!sig) luaL_error(L, "LuaFFI: %s", err);
+    return sig;
+}
+
+static int signature_gc(lua_State* L) {
+    Signature** ud = (Signature**)lua_touserdata(L, 1);
+    if (ud && *ud) {
+        signature_release(*ud);
+        *ud = NULL;
+    }
+    return 0;
+}
+
+static int signature_tostring(lua_State* L) {
+    Signature** ud = (Signature**)luaL_checkudata(L, 1, "Signature");
+    lua_pushfstring(L, "Signature(\"%s\")", *ud ? (*ud)->text : "");
+    return 1;
+}
+
+/* ---------- LuaFFI.signature：获取驻留的签名句柄 ---------- */
+int newSignature(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 1);
+    LUA_TYPE_ASSERT(L, string, 1);
+    /* 先建好句柄再取引用，分配失败抛错时不会泄漏签名 */
+    Signature** ud = (Signature**)lua_newuserdata(L, sizeof(Signature*));
+    *ud = NULL;
+    luaL_setmetatable(L, "Signature");
+    *ud = check_signature(L, 1);
+    return 1;
+}
+
 int setAbi(lua_State* L) {
     LUA_ARGC_ASSERT(L, 1);
     LUA_TYPE_ASSERT(L, integer, 1);
@@ -138,9 +491,9 @@ int setAbi(lua_State* L) {
 }
 
 int registerStructType(lua_State* L) {
-    LUA_ARGC_ASSERT(L, 2);
     LUA_TYPE_ASSERT(L, string, 1);
     LUA_TYPE_ASSERT(L, string, 2);
+    if (!lua_isnoneornil(L, 3)) LUA_TYPE_ASSERT(L, table, 3);
     
     const char* key = lua_tostring(L, 1);
     const char* sign = lua_tostring(L, 2);
@@ -149,28 +502,46 @@ int registerStructType(lua_State* L) {
     LUA_ALLOC_ASSERT(L, elements);
     
     int count = 0;
-    for (; *(elements + count); count++);  // 字段个数
-    
-    size_t* offsets = malloc(count * sizeof(size_t));
-    LUA_ALLOC_ASSERT(L, offsets);
-    
-    char* name = strdup(key);
-    LUA_ALLOC_ASSERT(L, name);
-    
-    Structure type = {
-        .type = (ffi_type){
-            .size = 0,
-            .alignment = 0,
-            .type = FFI_TYPE_STRUCT,
-            .elements = elements
-        },
-        .name = name,
-        .offsets = offsets   // 仍保留，供 C 内部使用（例如 ffi_get_struct_offsets）
-    };
-    STRUCTMAP_PUT(key, type);
+    for (; *(elements + count); count++) {  // 字段个数
+        if (is_string_type(elements[count]) || is_out_marker(elements[count])) {
+            types_free(elements);
+            luaL_error(L, "LuaFFI: z/Z/&/* are only valid in function signatures");
+        }
+    }
     
-    if (ffi_get_struct_offsets(__g_abi, &STRUCTMAP_GET(key)->type, offsets) == FFI_BAD_TYPEDEF) 
+    /* 字段类型中的结构体引用随 elements 转交给新结构体，出错时由 structure_free 一并释放 */
+    Structure* type = calloc(1, sizeof(Structure));
+    if (!type) types_free(elements);
+    LUA_ALLOC_ASSERT(L, type);
+    type->type.type = FFI_TYPE_STRUCT;
+    type->type.elements = elements;
+    type->nfields = count;
+    type->refcount = 1;
+    type->offsets = malloc((count ? count : 1) * sizeof(size_t));  // 仍保留，供 C 内部使用
+    type->name = strdup(key);
+    if (!type->offsets || !type->name) {
+        structure_free(type);
+        luaL_error(L, "LuaFFI: %s failed to alloc mem", __func__);
+    }
+    if (!lua_isnoneornil(L, 3)) {
+        const char* err = struct_set_field_names(L, type, 3);
+        if (err) {
+            structure_free(type);
+            luaL_error(L, "LuaFFI: %s", err);
+        }
+    }
+
+    /* 布局在发布前计算，并发的查找不会看到未完成的结构体 */
+    if (ffi_get_struct_offsets(__g_abi, &type->type, type->offsets) == FFI_BAD_TYPEDEF) {
+        structure_free(type);
         luaL_error(L, "LuaFFI: bad typedef");
+    }
+    if (STRUCTMAP_PUT(type) < 0) {
+        structure_free(type);
+        luaL_error(L, "LuaFFI: %s failed to alloc mem", __func__);
+    }
+    
+    signature_table_clear();   // 已驻留签名可能引用旧布局
     
     return 0;
 }
@@ -180,312 +551,1406 @@ int unregisterStructType(lua_State* L) {
     LUA_TYPE_ASSERT(L, string, 1);
     const char* key = lua_tostring(L, 1);
     STRUCTMAP_DEL(key);
+    signature_table_clear();
     return 0;
 }
 
-/* ---------- 从 Lua 值转换为 C 值 ---------- */
-static void lua_to_cvalue(lua_State* L, int idx, ffi_type* type, void* out) {
-    if (type->type == FFI_TYPE_STRUCT) {
-        Structure* st = get_structure(type);
-        if (!st) luaL_error(L, "LuaFFI: Unknown structure type");
-        luaL_checktype(L, idx, LUA_TTABLE);
-
-        ffi_type** elems = type->elements;
-        size_t* offsets = st->offsets;
-        for (int i = 0; elems[i] != NULL; i++) {
-            lua_rawgeti(L, idx, i + 1);                // 取数组第 i+1 个元素
-            void* field_ptr = (char*)out + offsets[i];
-            lua_to_cvalue(L, -1, elems[i], field_ptr); // 递归填充字段
-            lua_pop(L, 1);
-        }
-        return;
+/* ---------- LuaFFI.registerArray(name, elemType, n)：注册定长数组类型 ---------- */
+int registerArrayType(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 3);
+    LUA_TYPE_ASSERT(L, string, 1);
+    LUA_TYPE_ASSERT(L, string, 2);
+    LUA_TYPE_ASSERT(L, integer, 3);
+
+    const char* key = lua_tostring(L, 1);
+    lua_Integer n = lua_tointeger(L, 3);
+    if (n < 1 || n > INT32_MAX) luaL_error(L, "LuaFFI: bad array length %d", (int)n);
+
+    ffi_type** parsed = parse_string_fsm(lua_tostring(L, 2));
+    LUA_ALLOC_ASSERT(L, parsed);
+    ffi_type* elem = parsed[0];
+    int ok = elem && !parsed[1] && elem != (ffi_type*)VARIABLE && elem->type != FFI_TYPE_VOID &&
+             !is_string_type(elem) && !is_out_marker(elem);
+    if (!ok) {
+        types_free(parsed);
+        luaL_error(L, "LuaFFI: array element type must be a single non-void type");
+    }
+    free(parsed);   // 元素类型的引用转交给数组类型
+
+    /* 元素类型的大小与对齐（结构体在注册时已由 ffi_get_struct_offsets 计算） */
+    size_t align = elem->alignment ? elem->alignment : 1;
+    size_t stride = (elem->size + align - 1) & ~(align - 1);
+    if (stride == 0 || (size_t)n > SIZE_MAX / stride) {
+        type_release(elem);
+        luaL_error(L, "LuaFFI: array too large");
+    }
+    size_t size = stride * (size_t)n;
+
+    Structure* type = calloc(1, sizeof(Structure));
+    if (!type) type_release(elem);
+    LUA_ALLOC_ASSERT(L, type);
+    type->type.size = size;
+    type->type.alignment = (unsigned short)align;
+    type->type.type = FFI_TYPE_STRUCT;
+    type->nfields = (int)n;
+    type->elem = elem;
+    type->stride = stride;
+    type->refcount = 1;
+
+    /* 小数组展开完整元素列表供 libffi 对按值传递分类，大数组只保留一个元素并预置大小 */
+    size_t nelem = size <= ARRAY_EXPAND_MAX_SIZE ? (size_t)n : 1;
+    ffi_type** elements = malloc((nelem + 1) * sizeof(ffi_type*));
+    if (elements) {
+        for (size_t i = 0; i < nelem; i++) elements[i] = elem;
+        elements[nelem] = NULL;
+    }
+    type->type.elements = elements;
+    type->name = strdup(key);
+    if (!elements || !type->name || STRUCTMAP_PUT(type) < 0) {
+        structure_free(type);
+        luaL_error(L, "LuaFFI: %s failed to alloc mem", __func__);
     }
 
-    switch (type->type) {
-        case FFI_TYPE_SINT8:
-        case FFI_TYPE_UINT8:
-        case FFI_TYPE_SINT16:
-        case FFI_TYPE_UINT16:
-        case FFI_TYPE_SINT32:
-        case FFI_TYPE_UINT32:
-        case FFI_TYPE_SINT64:
-        case FFI_TYPE_UINT64: {
-            lua_Integer val = luaL_checkinteger(L, idx);
-            size_t sz = type->size;
-            if (sz == 1)      *(uint8_t*) out = (uint8_t) val;
-            else if (sz == 2) *(uint16_t*)out = (uint16_t)val;
-            else if (sz == 4) *(uint32_t*)out = (uint32_t)val;
-            else if (sz == 8) *(uint64_t*)out = (uint64_t)val;
-            break;
-        }
-        case FFI_TYPE_FLOAT: {
-            float val = (float)luaL_checknumber(L, idx);
-            *(float*)out = val;
-            break;
-        }
-        case FFI_TYPE_DOUBLE: {
-            double val = luaL_checknumber(L, idx);
-            *(double*)out = val;
-            break;
-        }
-        case FFI_TYPE_LONGDOUBLE: {
-            long double val = (long double)luaL_checknumber(L, idx);
-            *(long double*)out = val;
-            break;
-        }
-        case FFI_TYPE_POINTER: {
-            void* ptr = lua_touserdata(L, idx);
-            *(void**)out = ptr;
-            break;
-        }
-        default:
-            luaL_error(L, "LuaFFI: Unsupported ffi_type: %d", type->type);
+    signature_table_clear();
+    return 0;
+}
+
+/* 检查 idx 处是否为指定类型的结构体视图（type 为 NULL 时不检查类型） */
+static StructView* test_struct_view(lua_State* L, int idx, ffi_type* type) {
+    StructView* v = (StructView*)luaL_testudata(L, idx, "StructView");
+    if (v && type && &v->st->type != type) return NULL;
+    return v;
+}
+
+/* ---------- 编组计划：叶子类型转换函数 ---------- */
+static void to_c_u8(lua_State* L, int idx, void* out)  { *(uint8_t*)out  = (uint8_t)luaL_checkinteger(L, idx); }
+static void to_c_u16(lua_State* L, int idx, void* out) { *(uint16_t*)out = (uint16_t)luaL_checkinteger(L, idx); }
+static void to_c_u32(lua_State* L, int idx, void* out) { *(uint32_t*)out = (uint32_t)luaL_checkinteger(L, idx); }
+static void to_c_u64(lua_State* L, int idx, void* out) { *(uint64_t*)out = (uint64_t)luaL_checkinteger(L, idx); }
+static void to_c_float(lua_State* L, int idx, void* out)  { *(float*)out = (float)luaL_checknumber(L, idx); }
+static void to_c_double(lua_State* L, int idx, void* out) { *(double*)out = luaL_checknumber(L, idx); }
+static void to_c_ldouble(lua_State* L, int idx, void* out) { *(long double*)out = (long double)luaL_checknumber(L, idx); }
+static void to_c_pointer(lua_State* L, int idx, void* out) {
+    void* p = lua_touserdata(L, idx);
+    if (p && lua_type(L, idx) == LUA_TUSERDATA) {
+        StructView* v = (StructView*)luaL_testudata(L, idx, "StructView");
+        LuaClosureHandle* h;
+        MappedFile* m;
+        if (v) p = v->ptr;      // 结构体视图按其指向的内存传递
+        else if ((h = (LuaClosureHandle*)luaL_testudata(L, idx, "LuaClosure"))) p = h->code;
+        else if ((m = (MappedFile*)luaL_testudata(L, idx, "MappedFile"))) p = m->base;   // 映射文件传递首条记录地址
     }
+    *(void**)out = p;
 }
 
-/* ---------- 将 C 值转换为 Lua 值并压栈 ---------- */
-static void lua_push_cvalue(lua_State* L, void* value, ffi_type* type) {
-    if (type->type == FFI_TYPE_STRUCT) {
-        Structure* st = get_structure(type);
-        if (!st) luaL_error(L, "LuaFFI: Unknown structure type");
-        lua_newtable(L);
-        ffi_type** elems = type->elements;
-        size_t* offsets = st->offsets;
-        for (int i = 0; elems[i] != NULL; i++) {
-            void* field_ptr = (char*)value + offsets[i];
-            lua_push_cvalue(L, field_ptr, elems[i]);
-            lua_rawseti(L, -2, i + 1);
-        }
-        return;
+/* 指针参数及其后可访问的字节数：视图为结构体大小，映射文件为映射长度，其他 full userdata 为其大小，
+ * 闭包句柄不是数据缓冲区（为 0）；lightuserdata 无从得知，为 SIZE_MAX，由调用方保证 */
+static void* to_c_buffer(lua_State* L, int idx, size_t* capacity) {
+    void* p;
+    to_c_pointer(L, idx, &p);
+    *capacity = SIZE_MAX;
+    if (lua_type(L, idx) == LUA_TUSERDATA) {
+        StructView* v = (StructView*)luaL_testudata(L, idx, "StructView");
+        MappedFile* m;
+        if (v) *capacity = v->st->type.size;
+        else if ((m = (MappedFile*)luaL_testudata(L, idx, "MappedFile"))) *capacity = m->closed ? 0 : m->length;
+        else if (luaL_testudata(L, idx, "LuaClosure")) *capacity = 0;
+        else *capacity = lua_rawlen(L, idx);
     }
+    return p;
+}
+
+static void to_lua_s8(lua_State* L, const void* in)  { lua_pushinteger(L, *(const int8_t*)in); }
+static void to_lua_u8(lua_State* L, const void* in)  { lua_pushinteger(L, *(const uint8_t*)in); }
+static void to_lua_s16(lua_State* L, const void* in) { lua_pushinteger(L, *(const int16_t*)in); }
+static void to_lua_u16(lua_State* L, const void* in) { lua_pushinteger(L, *(const uint16_t*)in); }
+static void to_lua_s32(lua_State* L, const void* in) { lua_pushinteger(L, *(const int32_t*)in); }
+static void to_lua_u32(lua_State* L, const void* in) { lua_pushinteger(L, *(const uint32_t*)in); }
+static void to_lua_64(lua_State* L, const void* in)  { lua_pushinteger(L, (lua_Integer)*(const uint64_t*)in); }
+static void to_lua_float(lua_State* L, const void* in)   { lua_pushnumber(L, *(const float*)in); }
+static void to_lua_double(lua_State* L, const void* in)  { lua_pushnumber(L, *(const double*)in); }
+static void to_lua_ldouble(lua_State* L, const void* in) { lua_pushnumber(L, (double)*(const long double*)in); }
+static void to_lua_pointer(lua_State* L, const void* in) { lua_pushlightuserdata(L, *(void* const*)in); }
+
+/* z：直接传递 Lua 字符串的内部指针（调用期间参数留在栈上，指针有效），nil 为 NULL，userdata 按指针传递 */
+static void to_c_string(lua_State* L, int idx, void* out) {
+    int t = lua_type(L, idx);
+    if (t == LUA_TSTRING) *(const char**)out = lua_tostring(L, idx);
+    else if (t == LUA_TNIL) *(const char**)out = NULL;
+    else if (t == LUA_TUSERDATA || t == LUA_TLIGHTUSERDATA) to_c_pointer(L, idx, out);
+    else luaL_error(L, "LuaFFI: z expects a string, nil or userdata, got %s", lua_typename(L, t));
+}
+
+static void to_lua_string(lua_State* L, const void* in) {
+    const char* str = *(const char* const*)in;
+    if (str) lua_pushstring(L, str);
+    else lua_pushnil(L);
+}
 
+/* 为标量类型选择转换函数，不支持的类型返回 0 */
+static int plan_leaf_funcs(ffi_type* type, ToCFunc* to_c, ToLuaFunc* to_lua) {
+    if (type == &__ffi_type_string) {
+        *to_c = to_c_string;
+        *to_lua = to_lua_string;
+        return 1;
+    }
+    if (type == &__ffi_type_lstring || type == &__ffi_type_lstring_len) return 0;  // 由 STEP_LSTRING 处理
     switch (type->type) {
-        case FFI_TYPE_VOID:
-            lua_pushnil(L);
-            break;
-        case FFI_TYPE_SINT8:
-        case FFI_TYPE_UINT8:
-        case FFI_TYPE_SINT16:
-        case FFI_TYPE_UINT16:
-        case FFI_TYPE_SINT32:
-        case FFI_TYPE_UINT32:
+        case FFI_TYPE_SINT8:      *to_c = to_c_u8;      *to_lua = to_lua_s8;      return 1;
+        case FFI_TYPE_UINT8:      *to_c = to_c_u8;      *to_lua = to_lua_u8;      return 1;
+        case FFI_TYPE_SINT16:     *to_c = to_c_u16;     *to_lua = to_lua_s16;     return 1;
+        case FFI_TYPE_UINT16:     *to_c = to_c_u16;     *to_lua = to_lua_u16;     return 1;
+        case FFI_TYPE_SINT32:     *to_c = to_c_u32;     *to_lua = to_lua_s32;     return 1;
+        case FFI_TYPE_UINT32:     *to_c = to_c_u32;     *to_lua = to_lua_u32;     return 1;
         case FFI_TYPE_SINT64:
-        case FFI_TYPE_UINT64: {
-            lua_Integer v = 0;
-            size_t sz = type->size;
-            if (sz == 1) v = *(uint8_t*) value;
-            else if (sz == 2) v = *(uint16_t*)value;
-            else if (sz == 4) v = *(uint32_t*)value;
-            else if (sz == 8) v = *(uint64_t*)value;
-            lua_pushinteger(L, v);
-            break;
-        }
-        case FFI_TYPE_FLOAT:
-            lua_pushnumber(L, *(float*)value);
-            break;
-        case FFI_TYPE_DOUBLE:
-            lua_pushnumber(L, *(double*)value);
-            break;
-        case FFI_TYPE_LONGDOUBLE:
-            lua_pushnumber(L, (double)*(long double*)value);
-            break;
-        case FFI_TYPE_POINTER:
-            lua_pushlightuserdata(L, *(void**)value);
-            break;
-        default:
-            lua_pushnil(L);
-            break;
+        case FFI_TYPE_UINT64:     *to_c = to_c_u64;     *to_lua = to_lua_64;      return 1;
+        case FFI_TYPE_FLOAT:      *to_c = to_c_float;   *to_lua = to_lua_float;   return 1;
+        case FFI_TYPE_DOUBLE:     *to_c = to_c_double;  *to_lua = to_lua_double;  return 1;
+        case FFI_TYPE_LONGDOUBLE: *to_c = to_c_ldouble; *to_lua = to_lua_ldouble; return 1;
+        case FFI_TYPE_POINTER:    *to_c = to_c_pointer; *to_lua = to_lua_pointer; return 1;
+        default: return 0;
     }
 }
 
-/* ---------- enterNativeFunction __call 元方法 ---------- */
-int enterNativeFunction(lua_State* L) {
-    NativeFunction** ud = (NativeFunction**)lua_touserdata(L, 1);
-    if (!ud) luaL_error(L, "LuaFFI: Expected NativeFunction userdata");
-    NativeFunction* nf = *ud;
-    if (!nf) luaL_error(L, "LuaFFI: NativeFunction is NULL");
-
-    int nargs = lua_gettop(L) - 1;
-
-    /* ---------- 可变参数分支 ---------- */
-    if (nf->is_variadic) {
-        if (nargs < nf->nfixed)
-            luaL_error(L, "LuaFFI: Not enough arguments (need at least %d)", nf->nfixed);
-        int nvar = nargs - nf->nfixed;
-        int total = nf->nfixed + nvar;
-
-        /* 动态构建参数类型数组（栈上分配） */
-        ffi_type** arg_types = alloca(total * sizeof(ffi_type*));
-        for (int i = 0; i < nf->nfixed; i++)
-            arg_types[i] = nf->fixed_types[i];
-        for (int i = 0; i < nvar; i++)
-            arg_types[nf->nfixed + i] = nf->var_promoted;
-
-        /* 临时 cif（栈上分配） */
-        ffi_cif cif;
-        ffi_status s = ffi_prep_cif_var(&cif, FFI_DEFAULT_ABI,
-                                        nf->nfixed, total,
-                                        nf->ret_type, arg_types);
-        if (s != FFI_OK) luaL_error(L, "LuaFFI: ffi_prep_cif_var failed");
-
-        /* 构造参数指针数组 */
-        void* args[total];
-        for (int i = 0; i < total; i++) {
-            void* buf = alloca(arg_types[i]->size);          // 分配足够空间
-            lua_to_cvalue(L, i + 2, arg_types[i], buf);      // 填充值
-            args[i] = buf;
-        }
-
-        /* 返回值缓冲区 */
-        void* ret_buf = NULL;
-        if (nf->ret_type->type != FFI_TYPE_VOID) {
-            size_t sz = nf->ret_type->size;
-            if (nf->ret_type->type >= FFI_TYPE_UINT8 &&
-                nf->ret_type->type <= FFI_TYPE_SINT32 &&
-                sz < sizeof(ffi_arg))
-                sz = sizeof(ffi_arg);
-            ret_buf = alloca(sz);
-            memset(ret_buf, 0, sz);
-        }
-
-        ffi_call(&cif, FFI_FN(nf->func_ptr), ret_buf, args);
-
-        if (nf->ret_type->type != FFI_TYPE_VOID) {
-            lua_push_cvalue(L, ret_buf, nf->ret_type);
-            return 1;
-        }
-        return 0;
+static MarshalStep* plan_push_step(MarshalPlan* plan, int* cap) {
+    if (plan->nsteps == *cap) {
+        int ncap = *cap ? *cap * 2 : 8;
+        MarshalStep* steps = realloc(plan->steps, ncap * sizeof(MarshalStep));
+        if (!steps) return NULL;
+        plan->steps = steps;
+        *cap = ncap;
     }
+    MarshalStep* step = &plan->steps[plan->nsteps++];
+    memset(step, 0, sizeof(MarshalStep));
+    return step;
+}
 
-    /* ---------- 非可变参数分支（使用预先生成的 cif） ---------- */
-    if (nargs != nf->nfixed)
-        luaL_error(L, "LuaFFI: NativeFunction expected %d arguments, got %d",
-                   nf->nfixed, nargs);
+/* 递归展开一个类型（仅在编译期递归，调用期为线性遍历） */
+static int plan_emit(MarshalPlan* plan, int* cap, ffi_type* type, int arg,
+                     int field, const char* name, size_t offset, int depth) {
+    if (type == &__ffi_type_lstring || type == &__ffi_type_lstring_len) {
+        /* Z 只能作为顶层参数；长度参数由前一个指针参数的步骤一并处理 */
+        if (field != 0) return 0;
+        if (type == &__ffi_type_lstring_len) return 1;
+        MarshalStep* step = plan_push_step(plan, cap);
+        if (!step) return 0;
+        step->kind   = STEP_LSTRING;
+        step->arg    = arg;
+        step->offset = offset;
+        return 1;
+    }
+    if (type->type != FFI_TYPE_STRUCT) {
+        MarshalStep* step = plan_push_step(plan, cap);
+        if (!step) return 0;
+        step->kind   = STEP_LEAF;
+        step->arg    = arg;
+        step->field  = field;
+        step->name   = name;
+        step->offset = offset;
+        return plan_leaf_funcs(type, &step->to_c, &step->to_lua);
+    }
 
-    void* args[nf->nfixed];
-    for (int i = 0; i < nf->nfixed; i++) {
-        void* buf = alloca(nf->fixed_types[i]->size);          // 分配足够空间
-        lua_to_cvalue(L, i + 2, nf->fixed_types[i], buf);      // 填充值
-        args[i] = buf;
+    Structure* st = get_structure(type);
+    int nfields = st->nfields;
+
+    if (st->elem) {
+        /* 数组：单个步骤按元素间距循环，不逐元素展开 */
+        MarshalStep* step = plan_push_step(plan, cap);
+        if (!step) return 0;
+        step->kind    = STEP_ARRAY;
+        step->arg     = arg;
+        step->field   = field;
+        step->name    = name;
+        step->nfields = nfields;
+        step->type    = type;
+        step->stride  = st->stride;
+        step->offset  = offset;
+        if (depth + 1 > plan->depth) plan->depth = depth + 1;
+        if (st->elem->type != FFI_TYPE_STRUCT)
+            return plan_leaf_funcs(st->elem, &step->to_c, &step->to_lua);
+        return 1;                       // 结构体元素：调用期走通用路径
     }
 
-    void* ret_buf = NULL;
-    if (nf->ret_type->type != FFI_TYPE_VOID) {
-        size_t sz = nf->ret_type->size;
-        if (nf->ret_type->type >= FFI_TYPE_UINT8 &&
-            nf->ret_type->type <= FFI_TYPE_SINT32 &&
-            sz < sizeof(ffi_arg))
-            sz = sizeof(ffi_arg);
-        ret_buf = alloca(sz);
-        memset(ret_buf, 0, sz);
+    MarshalStep* enter = plan_push_step(plan, cap);
+    if (!enter) return 0;
+    int enter_idx = plan->nsteps - 1;
+    enter->kind    = STEP_ENTER;
+    enter->arg     = arg;
+    enter->field   = field;
+    enter->name    = name;
+    enter->nfields = nfields;
+    enter->type    = type;
+    enter->offset  = offset;
+    if (depth + 1 > plan->depth) plan->depth = depth + 1;
+
+    for (int i = 0; i < nfields; i++) {
+        if (!plan_emit(plan, cap, type->elements[i], arg, i + 1,
+                       st->field_names ? st->field_names[i] : NULL,
+                       offset + st->offsets[i], depth + 1))
+            return 0;
     }
 
-    ffi_call(&nf->cif, FFI_FN(nf->func_ptr), ret_buf, args);
+    MarshalStep* leave = plan_push_step(plan, cap);
+    if (!leave) return 0;
+    leave->kind  = STEP_LEAVE;
+    leave->arg   = arg;
+    leave->field = field;
+    leave->name  = name;
+    plan->steps[enter_idx].skip = plan->nsteps - 1 - enter_idx;
+    return 1;
+}
 
-    if (nf->ret_type->type != FFI_TYPE_VOID) {
-        lua_push_cvalue(L, ret_buf, nf->ret_type);
-        return 1;
-    }
-    return 0;
+/* 输出参数：被指向的存储紧随指针参数分配在参数帧中（slot 为指针参数的偏移），
+ * *T 再按被指向的类型从对应的 Lua 参数编组 */
+static int plan_emit_out(MarshalPlan* plan, int* cap, ffi_type* marker, ffi_type* pointee,
+                         int arg, size_t slot, size_t* frame) {
+    size_t align = pointee->alignment ? pointee->alignment : 1;
+    size_t storage = (*frame + align - 1) & ~(align - 1);
+    *frame = storage + pointee->size;
+
+    MarshalStep* step = plan_push_step(plan, cap);
+    if (!step) return 0;
+    step->kind   = marker == &__ffi_type_out ? STEP_OUT : STEP_INOUT;
+    step->arg    = arg;
+    step->type   = pointee;
+    step->offset = storage - slot;
+    if (marker == &__ffi_type_out) return 1;
+    return plan_emit(plan, cap, pointee, arg, 0, NULL, storage - slot, 0);
 }
 
-/* ---------- __gc 元方法 ---------- */
-static int nativefunction_gc(lua_State* L) {
-    NativeFunction** ud = (NativeFunction**)lua_touserdata(L, 1);
-    if (ud && *ud) {
-        NativeFunction* nf = *ud;
-        free(nf->sign_base);      // 释放 parse_string_fsm 返回的数组
-        free(nf->fixed_types);    // 释放固定参数类型数组
-        free(nf);
-        *ud = NULL;
+/* 编译 ntypes 个参数的编组计划，并计算连续参数帧布局（输出参数的标记与被指向类型合为一个参数） */
+static int plan_compile(MarshalPlan* plan, ffi_type** types, int ntypes) {
+    memset(plan, 0, sizeof(MarshalPlan));
+    if (ntypes == 0) return 1;
+
+    plan->arg_offsets = malloc(ntypes * sizeof(size_t));
+    if (!plan->arg_offsets) return 0;
+
+    int cap = 0;
+    int lua_arg = 0;
+    size_t frame = 0;
+    for (int i = 0, c = 0; i < ntypes; i++, c++) {
+        ffi_type* type = types[i];
+        size_t align = type->alignment ? type->alignment : 1;
+        frame = (frame + align - 1) & ~(align - 1);
+        plan->arg_offsets[c] = frame;
+        frame += type->size;
+        int first = plan->nsteps;
+        int ok;
+        if (is_out_marker(type)) {
+            ok = plan_emit_out(plan, &cap, type, types[++i], c, plan->arg_offsets[c], &frame);
+        } else {
+            ok = plan_emit(plan, &cap, type, c, 0, NULL, 0, 0);
+        }
+        if (!ok) {
+            plan_free(plan);
+            return 0;
+        }
+        for (int k = first; k < plan->nsteps; k++)
+            plan->steps[k].lua_arg = lua_arg;
+        if (type != &__ffi_type_lstring_len && type != &__ffi_type_out) lua_arg++;
     }
-    return 0;
+    plan->frame_size = frame;
+    plan->nlua = lua_arg;
+    return 1;
 }
 
-/* ---------- wrapNativeFunction 构造函数 ---------- */
-int wrapNativeFunction(lua_State* L) {
-    LUA_ARGC_ASSERT(L, 2);
-    LUA_TYPE_ASSERT(L, lightuserdata, 1);
-    LUA_TYPE_ASSERT(L, string, 2);
+/* 由参数计划中的输出参数编译调用后追加返回值的计划（只用于 plan_to_lua，不含帧布局） */
+static int plan_compile_outputs(MarshalPlan* out, const MarshalPlan* args) {
+    memset(out, 0, sizeof(MarshalPlan));
+    int cap = 0;
+    for (int k = 0; k < args->nsteps; k++) {
+        const MarshalStep* step = &args->steps[k];
+        if (step->kind != STEP_OUT && step->kind != STEP_INOUT) continue;
+        if (!plan_emit(out, &cap, step->type, step->arg, 0, NULL, step->offset, 0)) {
+            plan_free(out);
+            return 0;
+        }
+        out->nlua++;
+    }
+    return 1;
+}
 
-    void* func_ptr = lua_touserdata(L, 1);
-    const char* sign = lua_tostring(L, 2);
-    ffi_type** sign_types = parse_string_fsm(sign);
-    LUA_FUNC_PARSE_ASSERT(L, sign_types);   // 确保至少有一个返回值和一个参数
+static void plan_free(MarshalPlan* plan) {
+    free(plan->steps);
+    free(plan->arg_offsets);
+    memset(plan, 0, sizeof(MarshalPlan));
+}
 
-    ffi_type* ret_type = sign_types[0];
-    ffi_type** params_start = sign_types + 1;
+static void store_field_value(lua_State* L, int idx, ffi_type* type, void* out);
+static void push_c_value(lua_State* L, ffi_type* type, const void* ptr);
 
-    /* ---------- 解析参数，分离固定参数与可变参数标记 ---------- */
-    int nfixed = 0;
-    int has_var = 0;
-    ffi_type* last_fixed = NULL;
-    int i;
-    for (i = 0; params_start[i] != NULL; i++) {
-        if (params_start[i] == (ffi_type*)VARIABLE) {
-            has_var = 1;
-            i++;  // 跳过标记
-            break;
-        }
-        nfixed++;
-        last_fixed = params_start[i];
+/* ---------- 数组步骤：标量元素按间距循环转换，字符串或同类型视图整体拷贝 ---------- */
+static void plan_array_to_c(lua_State* L, const MarshalStep* step, int idx, char* out) {
+    if (!step->to_c || !lua_istable(L, idx)) {
+        store_field_value(L, idx, step->type, out);     // 字符串、视图或结构体元素
+        return;
     }
-    /* 检查标记后是否还有多余参数（违反 ... 语义） */
-    if (has_var && params_start[i] != NULL) {
-        free(sign_types);
-        luaL_error(L, "LuaFFI: Variadic marker '...' must be at the end of signature");
+    for (int i = 1; i <= step->nfields; i++, out += step->stride) {
+        lua_rawgeti(L, idx, i);
+        step->to_c(L, -1, out);
+        lua_pop(L, 1);
     }
-    if (has_var && nfixed == 0)
-        luaL_error(L, "LuaFFI: Variadic function must have at least one fixed argument");
+}
 
-    /* ---------- 构建固定参数类型数组 ---------- */
-    ffi_type** fixed_types = NULL;
-    if (nfixed > 0) {
-        fixed_types = malloc(nfixed * sizeof(ffi_type*));
-        LUA_ALLOC_ASSERT(L, fixed_types);
-        for (int j = 0; j < nfixed; j++)
-            fixed_types[j] = params_start[j];
+static void plan_array_to_lua(lua_State* L, const MarshalStep* step, const char* in) {
+    if (!step->to_lua) {
+        push_c_value(L, step->type, in);
+        return;
     }
+    lua_createtable(L, step->nfields, 0);
+    for (int i = 1; i <= step->nfields; i++, in += step->stride) {
+        step->to_lua(L, in);
+        lua_rawseti(L, -2, i);
+    }
+}
 
-    /* ---------- 计算可变参数提升类型 ---------- */
-    ffi_type* var_promoted = NULL;
-    if (has_var && last_fixed) {
-        if (last_fixed == &ffi_type_float)
-            var_promoted = &ffi_type_double;
-        else if (last_fixed == &ffi_type_schar || last_fixed == &ffi_type_uchar ||
-                 last_fixed == &ffi_type_sshort || last_fixed == &ffi_type_ushort) {
-            /* 根据有符号性提升为 int 或 unsigned int */
-            if (last_fixed == &ffi_type_schar || last_fixed == &ffi_type_sshort)
-                var_promoted = &ffi_type_sint;
-            else
-                var_promoted = &ffi_type_uint;
-        } else {
-            var_promoted = last_fixed;   // 其他类型（double, pointer, struct...）保持不变
-        }
+/* 取栈顶表中的字段：命名字段优先按名字查找，缺失时退回按位置 */
+static inline void plan_get_field(lua_State* L, const MarshalStep* step) {
+    if (step->name) {
+        if (lua_getfield(L, -1, step->name) != LUA_TNIL) return;
+        lua_pop(L, 1);
     }
+    lua_rawgeti(L, -1, step->field);
+}
 
-    /* ---------- 分配 NativeFunction ---------- */
-    NativeFunction* nf = malloc(sizeof(NativeFunction));
-    LUA_ALLOC_ASSERT(L, nf);
-    nf->func_ptr    = func_ptr;
-    nf->ret_type    = ret_type;
-    nf->fixed_types = fixed_types;
-    nf->nfixed      = nfixed;
-    nf->var_promoted = var_promoted;
-    nf->is_variadic = has_var;
-    nf->sign_base   = sign_types;      // 所有权转移，__gc 中释放
-
-    /* ---------- 非可变参数函数：预先生成 cif ---------- */
-    if (!has_var) {
-        ffi_status status = ffi_prep_cif(&nf->cif, FFI_DEFAULT_ABI, nfixed,
-                                         ret_type, fixed_types);
-        if (status != FFI_OK) {
-            free(sign_types);
-            free(fixed_types);
-            free(nf);
-            luaL_error(L, "LuaFFI: ffi_prep_cif failed: %d", status);
+/* ---------- 按计划将 Lua 参数（从 base 开始）写入 argv 指向的内存 ---------- */
+static void plan_to_c(lua_State* L, const MarshalPlan* plan, int base, void** argv) {
+    if (plan->depth > LUA_MINSTACK / 2)
+        luaL_checkstack(L, plan->depth, "LuaFFI: structure nested too deep");
+
+    const MarshalStep* step = plan->steps;
+    const MarshalStep* end = step + plan->nsteps;
+    for (; step < end; step++) {
+        char* out = (char*)argv[step->arg] + step->offset;
+        switch (step->kind) {
+            case STEP_LEAF:
+                if (step->field == 0) {
+                    step->to_c(L, base + step->lua_arg, out);
+                } else {
+                    plan_get_field(L, step);
+                    step->to_c(L, -1, out);
+                    lua_pop(L, 1);
+                }
+                break;
+            case STEP_ENTER:
+                if (step->field == 0) lua_pushvalue(L, base + step->lua_arg);
+                else plan_get_field(L, step);
+                if (!lua_istable(L, -1)) {
+                    /* 结构体视图：整体拷贝并跳过其字段步骤 */
+                    StructView* v = test_struct_view(L, -1, step->type);
+                    if (!v)
+                        luaL_error(L, "LuaFFI: argument %d expects a table or StructView for structure",
+                                   step->lua_arg + 1);
+                    memcpy(out, v->ptr, step->type->size);
+                    lua_pop(L, 1);
+                    step += step->skip;
+                }
+                break;
+            case STEP_LEAVE:
+                lua_pop(L, 1);
+                break;
+            case STEP_ARRAY:
+                if (step->field == 0) {
+                    plan_array_to_c(L, step, base + step->lua_arg, out);
+                } else {
+                    plan_get_field(L, step);
+                    plan_array_to_c(L, step, lua_gettop(L), out);
+                    lua_pop(L, 1);
+                }
+                break;
+            case STEP_LSTRING: {
+                /* Z：字符串内部指针与长度分别写入相邻的两个参数，nil 为 (NULL, 0) */
+                int idx = base + step->lua_arg;
+                size_t len = 0;
+                const char* str = NULL;
+                if (lua_type(L, idx) == LUA_TSTRING) str = lua_tolstring(L, idx, &len);
+                else if (!lua_isnil(L, idx))
+                    luaL_error(L, "LuaFFI: argument %d expects a string or nil", step->lua_arg + 1);
+                *(const char**)out = str;
+                *(size_t*)argv[step->arg + 1] = len;
+                break;
+            }
+            case STEP_OUT:
+                memset(out, 0, step->type->size);
+                /* fallthrough */
+            case STEP_INOUT:
+                /* 指针参数指向帧内的存储，*T 的初值由随后的步骤写入 */
+                *(void**)argv[step->arg] = out;
+                break;
         }
     }
+}
+
+/* ---------- 按计划将 argv 指向的 C 值依次压栈 ---------- */
+static void plan_to_lua(lua_State* L, const MarshalPlan* plan, void** argv) {
+    luaL_checkstack(L, plan->depth + plan->nsteps, "LuaFFI: too many values");
+
+    const MarshalStep* step = plan->steps;
+    const MarshalStep* end = step + plan->nsteps;
+    for (; step < end; step++) {
+        switch (step->kind) {
+            case STEP_LEAF:
+                step->to_lua(L, (char*)argv[step->arg] + step->offset);
+                if (step->name) lua_setfield(L, -2, step->name);
+                else if (step->field) lua_rawseti(L, -2, step->field);
+                break;
+            case STEP_ENTER:
+                if (get_structure(step->type)->field_names) lua_createtable(L, 0, step->nfields);
+                else lua_createtable(L, step->nfields, 0);
+                break;
+            case STEP_LEAVE:
+                if (step->name) lua_setfield(L, -2, step->name);
+                else if (step->field) lua_rawseti(L, -2, step->field);
+                break;
+            case STEP_ARRAY:
+                plan_array_to_lua(L, step, (char*)argv[step->arg] + step->offset);
+                if (step->name) lua_setfield(L, -2, step->name);
+                else if (step->field) lua_rawseti(L, -2, step->field);
+                break;
+            case STEP_LSTRING: {
+                const char* str = *(const char* const*)((char*)argv[step->arg] + step->offset);
+                if (str) lua_pushlstring(L, str, *(const size_t*)argv[step->arg + 1]);
+                else lua_pushnil(L);
+                break;
+            }
+        }
+    }
+}
+
+/* ---------- StructView：按 Structure.offsets 就地读写字段，不构造 Lua 表 ---------- */
+/* 压入自有视图，内容拷贝自 src（src 为 NULL 时清零） */
+static StructView* push_struct_view(lua_State* L, Structure* st, const void* src) {
+    size_t size = st->type.size;
+    StructView* v = (StructView*)lua_newuserdatauv(L, sizeof(StructView) + size, 1);
+    structure_retain(st);
+    v->st = st;
+    v->ptr = (char*)(v + 1);
+    if (src) memcpy(v->ptr, src, size);
+    else memset(v->ptr, 0, size);
+    luaL_setmetatable(L, "StructView");
+    return v;
+}
+
+/* 压入借用视图，anchor 处的值作为 uservalue 保持被引用内存存活（0 表示无） */
+static StructView* push_borrowed_view(lua_State* L, Structure* st, void* ptr, int anchor) {
+    if (anchor) anchor = lua_absindex(L, anchor);
+    StructView* v = (StructView*)lua_newuserdatauv(L, sizeof(StructView), 1);
+    structure_retain(st);
+    v->st = st;
+    v->ptr = (char*)ptr;
+    luaL_setmetatable(L, "StructView");
+    if (anchor) {
+        lua_pushvalue(L, anchor);
+        lua_setiuservalue(L, -2, 1);
+    }
+    return v;
+}
+
+/* 压入 base 处类型为 type 的值：标量直接转换，结构体返回借用视图 */
+static void push_field_value(lua_State* L, ffi_type* type, void* ptr, int anchor) {
+    if (type->type == FFI_TYPE_STRUCT) {
+        push_borrowed_view(L, get_structure(type), ptr, anchor);
+        return;
+    }
+    ToCFunc to_c;
+    ToLuaFunc to_lua;
+    if (!plan_leaf_funcs(type, &to_c, &to_lua))
+        luaL_error(L, "LuaFFI: Unsupported ffi_type: %d", type->type);
+    to_lua(L, ptr);
+}
+
+/* 将 idx 处的 Lua 值写入类型为 type 的内存（视图、表或标量） */
+static void store_field_value(lua_State* L, int idx, ffi_type* type, void* out) {
+    idx = lua_absindex(L, idx);
+    if (type->type != FFI_TYPE_STRUCT) {
+        ToCFunc to_c;
+        ToLuaFunc to_lua;
+        if (!plan_leaf_funcs(type, &to_c, &to_lua))
+            luaL_error(L, "LuaFFI: Unsupported ffi_type: %d", type->type);
+        to_c(L, idx, out);
+        return;
+    }
+
+    StructView* v = test_struct_view(L, idx, type);
+    if (v) {
+        memmove(out, v->ptr, type->size);
+        return;
+    }
+    Structure* st = get_structure(type);
+    if (st->elem && st->elem->type != FFI_TYPE_STRUCT && lua_type(L, idx) == LUA_TSTRING) {
+        /* 标量数组：字符串按原始字节拷贝，不足部分补 0 */
+        size_t len;
+        const char* bytes = lua_tolstring(L, idx, &len);
+        if (len > type->size)
+            luaL_error(L, "LuaFFI: %d bytes exceed array %s of %d bytes",
+                       (int)len, st->name, (int)type->size);
+        memcpy(out, bytes, len);
+        memset((char*)out + len, 0, type->size - len);
+        return;
+    }
+    if (!lua_istable(L, idx))
+        luaL_error(L, "LuaFFI: expects a table or StructView for structure");
+    for (int i = 0; i < st->nfields; i++) {
+        if (!st->field_names || lua_getfield(L, idx, st->field_names[i]) == LUA_TNIL) {
+            if (st->field_names) lua_pop(L, 1);
+            lua_rawgeti(L, idx, i + 1);
+        }
+        store_field_value(L, -1, struct_field_type(st, i), (char*)out + struct_field_offset(st, i));
+        lua_pop(L, 1);
+    }
+}
+
+/* 将类型为 type 的 C 值压栈，结构体与数组展开为 Lua 表（计划之外的冷路径） */
+static void push_c_value(lua_State* L, ffi_type* type, const void* ptr) {
+    if (type->type != FFI_TYPE_STRUCT) {
+        ToCFunc to_c;
+        ToLuaFunc to_lua;
+        if (!plan_leaf_funcs(type, &to_c, &to_lua))
+            luaL_error(L, "LuaFFI: Unsupported ffi_type: %d", type->type);
+        to_lua(L, ptr);
+        return;
+    }
+    Structure* st = get_structure(type);
+    luaL_checkstack(L, 2, "LuaFFI: structure nested too deep");
+    if (st->field_names) lua_createtable(L, 0, st->nfields);
+    else lua_createtable(L, st->nfields, 0);
+    for (int i = 0; i < st->nfields; i++) {
+        push_c_value(L, struct_field_type(st, i), (const char*)ptr + struct_field_offset(st, i));
+        if (st->field_names) lua_setfield(L, -2, st->field_names[i]);
+        else lua_rawseti(L, -2, i + 1);
+    }
+}
+
+/* 解析字段键，返回 0 起的字段序号，无效时返回 -1 */
+static int view_field_index(lua_State* L, StructView* v, int key) {
+    if (lua_type(L, key) == LUA_TSTRING) {
+        size_t len;
+        const char* name = lua_tolstring(L, key, &len);
+        return struct_field_find(v->st, name, len);
+    }
+    int isnum = 0;
+    lua_Integer i = lua_tointegerx(L, key, &isnum);
+    if (!isnum || i < 1 || i > v->st->nfields) return -1;
+    return (int)i - 1;
+}
+
+static int structview_index(lua_State* L) {
+    StructView* v = (StructView*)luaL_checkudata(L, 1, "StructView");
+    int i = view_field_index(L, v, 2);
+    if (i < 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    push_field_value(L, struct_field_type(v->st, i), v->ptr + struct_field_offset(v->st, i), 1);
+    return 1;
+}
+
+static int structview_newindex(lua_State* L) {
+    StructView* v = (StructView*)luaL_checkudata(L, 1, "StructView");
+    int i = view_field_index(L, v, 2);
+    if (i < 0) luaL_error(L, "LuaFFI: StructView %s has no field %s",
+                          v->st->name, luaL_tolstring(L, 2, NULL));
+    store_field_value(L, 3, struct_field_type(v->st, i), v->ptr + struct_field_offset(v->st, i));
+    return 0;
+}
+
+static int structview_len(lua_State* L) {
+    StructView* v = (StructView*)luaL_checkudata(L, 1, "StructView");
+    lua_pushinteger(L, v->st->nfields);
+    return 1;
+}
+
+static int structview_gc(lua_State* L) {
+    StructView* v = (StructView*)luaL_checkudata(L, 1, "StructView");
+    structure_release(v->st);
+    v->st = NULL;
+    return 0;
+}
+
+static int structview_tostring(lua_State* L) {
+    StructView* v = (StructView*)luaL_checkudata(L, 1, "StructView");
+    lua_pushfstring(L, "StructView(%s): %p", v->st->name, v->ptr);
+    return 1;
+}
+
+/* ---------- LuaFFI.view(name[, ptr])：创建结构体视图 ---------- */
+int newStructView(lua_State* L) {
+    LUA_TYPE_ASSERT(L, string, 1);
+    const char* name = lua_tostring(L, 1);
+    void* ptr = NULL;
+    if (!lua_isnoneornil(L, 2) && !(ptr = lua_touserdata(L, 2)))
+        luaL_error(L, "LuaFFI: view needs a pointer");
+    Structure* st = STRUCTMAP_ACQUIRE(name);
+    if (!st) luaL_error(L, "LuaFFI: unknown structure %s", name);
+
+    if (!ptr) push_struct_view(L, st, NULL);            // 自有内存，初始为 0
+    else push_borrowed_view(L, st, ptr, lua_type(L, 2) == LUA_TUSERDATA ? 2 : 0);
+    structure_release(st);                              // 视图已持有自己的引用
+    return 1;
+}
+
+/* ---------- LuaFFI.addressOf(obj)：视图或映射文件的内存地址、闭包句柄的可执行地址 ---------- */
+int structViewAddress(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 1);
+    LuaClosureHandle* h = (LuaClosureHandle*)luaL_testudata(L, 1, "LuaClosure");
+    if (h) {
+        lua_pushlightuserdata(L, h->code);
+        return 1;
+    }
+    MappedFile* m = (MappedFile*)luaL_testudata(L, 1, "MappedFile");
+    if (m) {
+        lua_pushlightuserdata(L, m->base);
+        return 1;
+    }
+    StructView* v = (StructView*)luaL_checkudata(L, 1, "StructView");
+    lua_pushlightuserdata(L, v->ptr);
+    return 1;
+}
+
+/* ---------- FieldAccessor：注册期解析字段路径，调用期不再查找名字 ---------- */
+/* 在 st 中解析一段字段名（也接受 1 起的数字），返回 0 起序号 */
+static int accessor_resolve_segment(const Structure* st, const char* seg, size_t len) {
+    int i = struct_field_find(st, seg, len);
+    if (i >= 0 || len == 0) return i;
+    int n = 0;
+    for (size_t k = 0; k < len; k++) {
+        if (seg[k] < '0' || seg[k] > '9' || n > st->nfields) return -1;
+        n = n * 10 + (seg[k] - '0');
+    }
+    return (n >= 1 && n <= st->nfields) ? n - 1 : -1;
+}
+
+/* 取访问器调用中的结构体地址：StructView 或指针 */
+static char* accessor_target(lua_State* L, FieldAccessor* fa, int idx) {
+    StructView* v = test_struct_view(L, idx, NULL);
+    if (v) {
+        if (v->st != fa->st)
+            luaL_error(L, "LuaFFI: accessor for %s applied to StructView %s", fa->st->name, v->st->name);
+        return v->ptr;
+    }
+    char* ptr = (char*)lua_touserdata(L, idx);
+    if (!ptr) luaL_error(L, "LuaFFI: accessor needs a pointer or StructView");
+    return ptr;
+}
+
+/* ---------- LuaFFI.accessor(name, field)：字段可为名字、"a.b" 路径或 1 起序号 ---------- */
+int newFieldAccessor(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 2);
+    LUA_TYPE_ASSERT(L, string, 1);
+    const char* name = lua_tostring(L, 1);
+
+    /* 先创建句柄并由其持有 st 的引用，后续解析出错时由 __gc 释放 */
+    FieldAccessor* fa = (FieldAccessor*)lua_newuserdatauv(L, sizeof(FieldAccessor), 0);
+    fa->st = NULL;
+    luaL_setmetatable(L, "FieldAccessor");
+    Structure* st = fa->st = STRUCTMAP_ACQUIRE(name);
+    if (!st) luaL_error(L, "LuaFFI: unknown structure %s", name);
+
+    Structure* cur = st;
+    ffi_type* type = NULL;
+    size_t offset = 0;
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        lua_Integer i = luaL_checkinteger(L, 2);
+        if (i < 1 || i > st->nfields) luaL_error(L, "LuaFFI: structure %s has no field %d", name, (int)i);
+        type = struct_field_type(st, (int)i - 1);
+        offset = struct_field_offset(st, (int)i - 1);
+    } else {
+        LUA_TYPE_ASSERT(L, string, 2);
+        const char* path = lua_tostring(L, 2);
+        for (const char* seg = path; ; ) {
+            const char* dot = strchr(seg, '.');
+            size_t len = dot ? (size_t)(dot - seg) : strlen(seg);
+            int i = cur ? accessor_resolve_segment(cur, seg, len) : -1;
+            if (i < 0) luaL_error(L, "LuaFFI: structure %s has no field %s", name, path);
+            type = struct_field_type(cur, i);
+            offset += struct_field_offset(cur, i);
+            if (!dot) break;
+            cur = get_structure(type);
+            seg = dot + 1;
+        }
+    }
+
+    fa->type = type;
+    fa->offset = offset;
+    return 1;
+}
+
+static int fieldaccessor_gc(lua_State* L) {
+    FieldAccessor* fa = (FieldAccessor*)luaL_checkudata(L, 1, "FieldAccessor");
+    structure_release(fa->st);
+    fa->st = NULL;
+    return 0;
+}
+
+/* acc(ptr) 读取字段；acc(ptr, value) 写入字段 */
+static int fieldaccessor_call(lua_State* L) {
+    FieldAccessor* fa = (FieldAccessor*)luaL_checkudata(L, 1, "FieldAccessor");
+    char* field = accessor_target(L, fa, 2) + fa->offset;
+    if (lua_gettop(L) >= 3) {
+        store_field_value(L, 3, fa->type, field);
+        return 0;
+    }
+    push_field_value(L, fa->type, field, lua_type(L, 2) == LUA_TUSERDATA ? 2 : 0);
+    return 1;
+}
+
+static int fieldaccessor_tostring(lua_State* L) {
+    FieldAccessor* fa = (FieldAccessor*)luaL_checkudata(L, 1, "FieldAccessor");
+    lua_pushfstring(L, "FieldAccessor(%s+%d)", fa->st->name, (int)fa->offset);
+    return 1;
+}
+
+/* ---------- 调用暂存区：替代 alloca，避免大结构体耗尽 C 栈 ---------- */
+static __thread ScratchArena __t_scratch;
+static pthread_key_t __g_scratch_key;
+static pthread_once_t __g_scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_key_init(void) {
+    pthread_key_create(&__g_scratch_key, free);     // 线程退出时释放该线程的暂存区
+}
+
+/* 弹出所有者栈地址不高于 owner 的帧：C 栈向下增长，这些帧要么属于 owner 本身，
+ * 要么属于已因 lua_error 被 longjmp 跳过的更深调用 */
+static inline void scratch_release(const void* owner) {
+    ScratchArena* a = &__t_scratch;
+    while (a->nmarks && a->marks[a->nmarks - 1].owner <= owner)
+        a->top = a->marks[--a->nmarks].top;
+}
+
+/* 分配 size 字节（SCRATCH_ALIGN 对齐），owner 为调用者的局部变量地址，
+ * 调用结束后以同一 owner 调用 scratch_release。暂存区不足时压入一个 userdata 代替 */
+static void* scratch_alloc(lua_State* L, size_t size, const void* owner) {
+    ScratchArena* a = &__t_scratch;
+    scratch_release(owner);
+
+    if (!a->base) {
+        pthread_once(&__g_scratch_once, scratch_key_init);
+        a->base = malloc(SCRATCH_SIZE);
+        if (a->base) pthread_setspecific(__g_scratch_key, a->base);
+    }
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    if (!a->base || a->nmarks == SCRATCH_MARKS || size > SCRATCH_SIZE - a->top)
+        return lua_newuserdatauv(L, size ? size : 1, 0);
+
+    a->marks[a->nmarks].owner = owner;
+    a->marks[a->nmarks].top = a->top;
+    a->nmarks++;
+    void* mem = a->base + a->top;
+    a->top += size;
+    return mem;
+}
+
+/* ---------- 按计划填充参数帧并调用目标函数，返回压栈的值个数 ---------- */
+/* 开启统计时取得（必要时创建）NativeFunction 的统计项 */
+static CallStats* native_stats(NativeFunction* nf) {
+    if (nf->stats) return nf->stats;
+    char label[256];
+    snprintf(label, sizeof(label), "%s @%p", nf->sig->text, nf->func_ptr);
+    return nf->stats = stats_new(STATS_NATIVE, label);
+}
+
+static int native_call(lua_State* L, NativeFunction* nf, ffi_cif* cif,
+                       const MarshalPlan* plan, int base) {
+    Signature* sig = nf->sig;
+    int has_ret = sig->ret_type->type != FFI_TYPE_VOID;
+    CallStats* st = stats_enabled() ? native_stats(nf) : NULL;
+    uint64_t t0 = 0, t1 = 0, t2 = 0;
+    if (st) t0 = stats_now();
+
+    /* 参数帧与返回值缓冲区取自暂存区，按预编译计划一次性填充 */
+    size_t frame_size = (plan->frame_size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    char* frame = scratch_alloc(L, frame_size + (has_ret ? sig->ret_size : 0), &sig);
+    int nargs = (int)cif->nargs;     // C 参数个数（Z 占两个）
+    void* args[nargs];
+    for (int i = 0; i < nargs; i++)
+        args[i] = frame + plan->arg_offsets[i];
+    plan_to_c(L, plan, base, args);
+
+    void* ret_buf = NULL;
+    if (has_ret) {
+        ret_buf = frame + frame_size;
+        memset(ret_buf, 0, sig->ret_size);
+    }
+
+    if (st) t1 = stats_now();
+    ffi_call(cif, FFI_FN(nf->func_ptr), ret_buf, args);
+    if (st) t2 = stats_now();
+
+    if (has_ret) {
+        if (nf->ret_view && sig->ret_type->type == FFI_TYPE_STRUCT)
+            push_struct_view(L, get_structure(sig->ret_type), ret_buf);
+        else
+            plan_to_lua(L, &sig->ret_plan, &ret_buf);
+    }
+    plan_to_lua(L, &sig->out_plan, args);      // 输出参数追加在返回值之后
+    scratch_release(&sig);
+    if (st) stats_record(st, t0, t1, t2, stats_now());
+    return has_ret + sig->out_plan.nlua;
+}
+
+/* ---------- 可变参数 cif 缓存 ---------- */
+static void var_call_free(VarCall* vc) {
+    for (int i = 0; i < vc->nvar; i++)
+        type_release(vc->arg_types[vc->nfixed + i]);
+    plan_free(&vc->plan);
+    free(vc->key);
+    free(vc);
+}
+
+/* 以 var_types（nvar 个，已提升）生成缓存项，失败时 *err 指向错误信息 */
+static VarCall* var_call_create(Signature* sig, int nvar, ffi_type** var_types,
+                                const char* key, const char** err) {
+    int total = sig->nfixed + nvar;
+    VarCall* vc = malloc(sizeof(VarCall) + total * sizeof(ffi_type*));
+    if (!vc) { *err = "out of memory"; return NULL; }
+    memset(vc, 0, sizeof(VarCall));
+    vc->nvar = nvar;
+    vc->nfixed = sig->nfixed;
+    vc->arg_types = (ffi_type**)(vc + 1);
+    memcpy(vc->arg_types, sig->arg_types, sig->nfixed * sizeof(ffi_type*));
+    memcpy(vc->arg_types + sig->nfixed, var_types, nvar * sizeof(ffi_type*));
+    for (int i = 0; i < nvar; i++)      // 固定参数的引用由签名持有
+        if (var_types[i]->type == FFI_TYPE_STRUCT) structure_retain(get_structure(var_types[i]));
+
+    if (key && !(vc->key = strdup(key))) {
+        var_call_free(vc);
+        *err = "out of memory";
+        return NULL;
+    }
+    if (ffi_prep_cif_var(&vc->cif, FFI_DEFAULT_ABI, sig->nfixed, total,
+                         sig->ret_type, vc->arg_types) != FFI_OK) {
+        var_call_free(vc);
+        *err = "ffi_prep_cif_var failed";
+        return NULL;
+    }
+    if (!plan_compile(&vc->plan, vc->arg_types, total)) {
+        var_call_free(vc);
+        *err = "unsupported variadic argument type";
+        return NULL;
+    }
+    return vc;
+}
+
+/* 插入按类型注解缓存的链表头部，超出上限时淘汰末尾项 */
+static void var_typed_insert(NativeFunction* nf, VarCall* vc) {
+    vc->next = nf->var_typed;
+    nf->var_typed = vc;
+    int n = 1;
+    for (VarCall* p = vc; p->next; p = p->next) {
+        if (++n > VAR_TYPED_MAX) {
+            var_call_free(p->next);
+            p->next = NULL;
+            break;
+        }
+    }
+}
+
+/* 可变参数按最后一个固定参数的提升类型传递，按个数缓存 */
+static VarCall* var_call_by_count(lua_State* L, NativeFunction* nf, int nvar) {
+    if (nvar < VAR_CACHE_SLOTS && nf->var_cache[nvar])
+        return nf->var_cache[nvar];
+    for (VarCall* vc = nf->var_typed; vc; vc = vc->next)
+        if (!vc->key && vc->nvar == nvar) return vc;
+
+    Signature* sig = nf->sig;
+    ffi_type** var_types = alloca(nvar * sizeof(ffi_type*));
+    for (int i = 0; i < nvar; i++)
+        var_types[i] = sig->var_promoted;
+
+    const char* err = NULL;
+    VarCall* vc = var_call_create(sig, nvar, var_types, NULL, &err);
+    if (!vc) luaL_error(L, "LuaFFI: %s", err);
+    if (nvar < VAR_CACHE_SLOTS) nf->var_cache[nvar] = vc;
+    else var_typed_insert(nf, vc);
+    return vc;
+}
+
+/* 可变参数类型由调用方注解给出（如 "dip"），按注解文本缓存 */
+static VarCall* var_call_by_types(lua_State* L, NativeFunction* nf, const char* types) {
+    for (VarCall* vc = nf->var_typed; vc; vc = vc->next)
+        if (vc->key && strcmp(vc->key, types) == 0) return vc;
+
+    ffi_type** var_types = parse_string_fsm(types);
+    LUA_ALLOC_ASSERT(L, var_types);
+    int nvar = 0;
+    for (; var_types[nvar]; nvar++) {
+        ffi_type* t = var_types[nvar];
+        /* 按 C 默认实参提升规则处理注解类型 */
+        if (t == (ffi_type*)VARIABLE || t == &ffi_type_void || t == &__ffi_type_lstring ||
+            t == &__ffi_type_lstring_len || is_out_marker(t)) {
+            types_free(var_types);
+            luaL_error(L, "LuaFFI: invalid variadic type annotation '%s'", types);
+        }
+        if (t == &ffi_type_float)
+            var_types[nvar] = &ffi_type_double;
+        else if (t == &ffi_type_schar || t == &ffi_type_sshort)
+            var_types[nvar] = &ffi_type_sint;
+        else if (t == &ffi_type_uchar || t == &ffi_type_ushort)
+            var_types[nvar] = &ffi_type_uint;
+    }
+
+    const char* err = NULL;
+    VarCall* vc = var_call_create(nf->sig, nvar, var_types, types, &err);
+    types_free(var_types);
+    if (!vc) luaL_error(L, "LuaFFI: %s", err);
+    var_typed_insert(nf, vc);
+    return vc;
+}
+
+static NativeFunction* check_native_function(lua_State* L, int idx) {
+    NativeFunction** ud = (NativeFunction**)lua_touserdata(L, idx);
+    if (!ud) luaL_error(L, "LuaFFI: Expected NativeFunction userdata");
+    if (!*ud) luaL_error(L, "LuaFFI: NativeFunction is NULL");
+    return *ud;
+}
+
+/* ---------- enterNativeFunction __call 元方法 ---------- */
+static int native_dispatch(lua_State* L, NativeFunction* nf) {
+    Signature* sig = nf->sig;
+    int nargs = lua_gettop(L) - 1;
+
+    /* ---------- 可变参数分支（按个数缓存 cif） ---------- */
+    int nlua = sig->args_plan.nlua;
+    if (sig->is_variadic) {
+        if (nargs < nlua)
+            luaL_error(L, "LuaFFI: Not enough arguments (need at least %d)", nlua);
+        VarCall* vc = var_call_by_count(L, nf, nargs - nlua);
+        return native_call(L, nf, &vc->cif, &vc->plan, 2);
+    }
+
+    /* ---------- 非可变参数分支（使用预先生成的 cif） ---------- */
+    if (nargs != nlua)
+        luaL_error(L, "LuaFFI: NativeFunction expected %d arguments, got %d", nlua, nargs);
+
+    /* 标量签名：直接调用，跳过 libffi（开启统计时走通用路径，以区分编组与目标函数耗时） */
+    if (sig->thunk && !stats_enabled())
+        return sig->thunk(L, nf->func_ptr, 2);
+
+    return native_call(L, nf, &sig->cif, &sig->args_plan, 2);
+}
+
+int enterNativeFunction(lua_State* L) {
+    NativeFunction* nf = check_native_function(L, 1);
+    if (!trace_enabled())
+        return native_dispatch(L, nf);
+
+    /* 追踪：记录进入/退出事件（调用抛出错误时只有进入事件） */
+    if (!trace_named(&nf->trace_epoch)) {
+        char label[256];
+        snprintf(label, sizeof(label), "%s @%p", nf->sig->text, nf->func_ptr);
+        trace_register(nf, &nf->trace_epoch, TRACE_NATIVE, label);
+    }
+    trace_emit(nf, 'B');
+    int nret = native_dispatch(L, nf);
+    trace_emit(nf, 'E');
+    return nret;
+}
+
+/* ---------- nf:vcall(types, ...)：带可变参数类型注解的调用 ---------- */
+static int nativefunction_vcall(lua_State* L) {
+    NativeFunction* nf = check_native_function(L, 1);
+    LUA_TYPE_ASSERT(L, string, 2);
+    Signature* sig = nf->sig;
+    if (!sig->is_variadic)
+        luaL_error(L, "LuaFFI: vcall needs a variadic NativeFunction");
+
+    VarCall* vc = var_call_by_types(L, nf, lua_tostring(L, 2));
+    int nargs = lua_gettop(L) - 2;
+    if (nargs != vc->plan.nlua)
+        luaL_error(L, "LuaFFI: vcall expected %d arguments, got %d", vc->plan.nlua, nargs);
+    return native_call(L, nf, &vc->cif, &vc->plan, 3);
+}
+
+/* ---------- 批量调用：在一个 C 循环内调用 n 次，复用参数帧与返回值缓冲区 ---------- */
+static int native_batch(lua_State* L, NativeFunction* nf, int args_idx, int res_idx) {
+    Signature* sig = nf->sig;
+    if (sig->is_variadic)
+        luaL_error(L, "LuaFFI: batch does not support variadic NativeFunction");
+    if (sig->out_plan.nlua)
+        luaL_error(L, "LuaFFI: batch does not support out-parameters");
+    luaL_checktype(L, args_idx, LUA_TTABLE);
+    luaL_checktype(L, res_idx, LUA_TTABLE);
+
+    int nfixed = sig->nfixed;
+    const MarshalPlan* plan = &sig->args_plan;
+    int nlua = plan->nlua;
+    int has_ret = sig->ret_type->type != FFI_TYPE_VOID;
+    lua_Integer n = (lua_Integer)lua_rawlen(L, args_idx);
+    luaL_checkstack(L, nlua + 2, "LuaFFI: too many arguments");
+
+    size_t frame_size = (plan->frame_size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    char* frame = scratch_alloc(L, frame_size + (has_ret ? sig->ret_size : 0), &sig);
+    void* args[nfixed];
+    for (int i = 0; i < nfixed; i++)
+        args[i] = frame + plan->arg_offsets[i];
+    void* ret_buf = has_ret ? frame + frame_size : NULL;
+
+    int top = lua_gettop(L);
+    for (lua_Integer k = 1; k <= n; k++) {
+        /* 单参数函数：元素即参数本身；多参数函数：元素为参数数组 */
+        int base = top + 1;
+        lua_rawgeti(L, args_idx, k);
+        if (nlua > 1) {
+            if (!lua_istable(L, base))
+                luaL_error(L, "LuaFFI: batch element %d must be an argument table", (int)k);
+            for (int i = 1; i <= nlua; i++)
+                lua_rawgeti(L, base, i);
+            base++;
+        }
+
+        if (sig->thunk) {
+            sig->thunk(L, nf->func_ptr, base);
+        } else {
+            plan_to_c(L, plan, base, args);
+            if (has_ret) memset(ret_buf, 0, sig->ret_size);
+            ffi_call(&sig->cif, FFI_FN(nf->func_ptr), ret_buf, args);
+            if (has_ret && nf->ret_view && sig->ret_type->type == FFI_TYPE_STRUCT)
+                push_struct_view(L, get_structure(sig->ret_type), ret_buf);
+            else if (has_ret)
+                plan_to_lua(L, &sig->ret_plan, &ret_buf);
+        }
+
+        if (has_ret) lua_rawseti(L, res_idx, k);
+        lua_settop(L, top);
+    }
+    scratch_release(&sig);
+    lua_pushvalue(L, res_idx);
+    return 1;
+}
+
+/* ---------- nf:batch(argsArray) -> results ---------- */
+static int nativefunction_batch(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 2);
+    NativeFunction* nf = check_native_function(L, 1);
+    lua_createtable(L, (int)lua_rawlen(L, 2), 0);
+    return native_batch(L, nf, 2, 3);
+}
+
+/* ---------- nf:batchInto(argsArray, results) -> results ---------- */
+static int nativefunction_batch_into(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 3);
+    NativeFunction* nf = check_native_function(L, 1);
+    return native_batch(L, nf, 2, 3);
+}
+
+/* ---------- nf:returnViews([flag]) -> nf：结构体返回值改为 StructView ---------- */
+static int nativefunction_return_views(lua_State* L) {
+    NativeFunction* nf = check_native_function(L, 1);
+    nf->ret_view = lua_isnone(L, 2) ? 1 : lua_toboolean(L, 2);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* ---------- 异步调用：参数在调用线程编组，ffi_call 在工作线程池中执行 ---------- */
+static void async_queue_release(AsyncQueue* q) {
+    if (__atomic_sub_fetch(&q->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&q->lock);
+        free(q);
+    }
+}
+
+static void async_job_release(AsyncJob* job) {
+    if (__atomic_sub_fetch(&job->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    signature_release(job->sig);
+    if (job->queue) async_queue_release(job->queue);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+/* 取得（必要时创建）该 Lua 状态的完成队列，注册表中的句柄持有一个引用 */
+static AsyncQueue* get_async_queue(lua_State* L) {
+    if (lua_getfield(L, LUA_REGISTRYINDEX, "LuaFFI.AsyncQueue") == LUA_TUSERDATA) {
+        AsyncQueue* q = *(AsyncQueue**)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return q;
+    }
+    lua_pop(L, 1);
+    AsyncQueue** ud = (AsyncQueue**)lua_newuserdatauv(L, sizeof(AsyncQueue*), 0);
+    *ud = calloc(1, sizeof(AsyncQueue));
+    LUA_ALLOC_ASSERT(L, *ud);
+    pthread_mutex_init(&(*ud)->lock, NULL);
+    (*ud)->refcount = 1;
+    luaL_setmetatable(L, "AsyncQueue");
+    lua_setfield(L, LUA_REGISTRYINDEX, "LuaFFI.AsyncQueue");
+    return *ud;
+}
+
+static int asyncqueue_gc(lua_State* L) {
+    AsyncQueue* q = *(AsyncQueue**)lua_touserdata(L, 1);
+    pthread_mutex_lock(&q->lock);
+    AsyncJob* job = q->head;
+    q->head = q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+    while (job) {
+        AsyncJob* next = job->next;
+        async_job_release(job);                 // 完成队列持有的引用
+        job = next;
+    }
+    async_queue_release(q);
+    return 0;
+}
+
+/* 工作线程：执行调用，置完成标志并唤醒等待者，最后登记到完成队列。
+ * 完成队列的引用在登记之后才可能被释放，因此句柄先被回收时 job 仍然存活；登记是对 job 的最后一次访问 */
+static void async_worker(void* arg) {
+    AsyncJob* job = (AsyncJob*)arg;
+    AsyncQueue* q = job->queue;
+    ffi_call(&job->sig->cif, FFI_FN(job->func_ptr), job->ret, job->args);
+
+    pthread_mutex_lock(&job->lock);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail) q->tail->next = job;
+    else q->head = job;
+    q->tail = job;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void async_job_wait(AsyncJob* job) {
+    if (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&job->lock);
+    while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&job->cond, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* 在 LuaFFI.AsyncPending 表中登记/移除句柄：未完成的句柄（及其锚定的参数）不会被回收 */
+static void async_pin(lua_State* L, AsyncJob* job, int handle) {
+    if (handle) handle = lua_absindex(L, handle);
+    if (lua_getfield(L, LUA_REGISTRYINDEX, "LuaFFI.AsyncPending") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, "LuaFFI.AsyncPending");
+    }
+    if (handle) lua_pushvalue(L, handle);
+    else lua_pushnil(L);
+    lua_rawsetp(L, -2, job);
+    lua_pop(L, 1);
+}
+
+/* 完成后的返回值与输出参数压栈（输出参数的存储在任务的参数帧中），返回值个数 */
+static int async_push_results(lua_State* L, AsyncJob* job) {
+    Signature* sig = job->sig;
+    int has_ret = sig->ret_type->type != FFI_TYPE_VOID;
+    if (has_ret && job->ret_view && sig->ret_type->type == FFI_TYPE_STRUCT)
+        push_struct_view(L, get_structure(sig->ret_type), job->ret);
+    else if (has_ret)
+        plan_to_lua(L, &sig->ret_plan, &job->ret);
+    plan_to_lua(L, &sig->out_plan, job->args);
+    return has_ret + sig->out_plan.nlua;
+}
+
+/* ---------- nf:async(...) -> AsyncCall ---------- */
+static int nativefunction_async(lua_State* L) {
+    NativeFunction* nf = check_native_function(L, 1);
+    Signature* sig = nf->sig;
+    if (sig->is_variadic)
+        luaL_error(L, "LuaFFI: async does not support variadic NativeFunction");
+    const MarshalPlan* plan = &sig->args_plan;
+    int nlua = lua_gettop(L) - 1;
+    if (nlua != plan->nlua)
+        luaL_error(L, "LuaFFI: NativeFunction expected %d arguments, got %d", plan->nlua, nlua);
+    int nargs = sig->nfixed;
+
+    /* 任务、参数指针、参数帧与返回值缓冲区一次分配 */
+    int has_ret = sig->ret_type->type != FFI_TYPE_VOID;
+    size_t head = (sizeof(AsyncJob) + nargs * sizeof(void*) + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    size_t frame_size = (plan->frame_size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    AsyncJob* job = malloc(head + frame_size + (has_ret ? sig->ret_size : 0));
+    LUA_ALLOC_ASSERT(L, job);
+    memset(job, 0, sizeof(AsyncJob));
+    job->func_ptr = nf->func_ptr;
+    job->sig = sig;
+    signature_retain(sig);
+    job->ret_view = nf->ret_view;
+    job->done = 1;              // 提交前视为已完成，编组出错时 __gc 可直接释放
+    job->refcount = 1;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    job->args = (void**)(job + 1);
+    char* frame = (char*)job + head;
+    for (int i = 0; i < nargs; i++)
+        job->args[i] = frame + plan->arg_offsets[i];
+    if (has_ret) {
+        job->ret = frame + frame_size;
+        memset(job->ret, 0, sig->ret_size);
+    }
+
+    AsyncJob** ud = (AsyncJob**)lua_newuserdatauv(L, sizeof(AsyncJob*), 1);
+    *ud = job;
+    luaL_setmetatable(L, "AsyncCall");
+    int handle = lua_gettop(L);
+
+    /* 参数表作为句柄的 uservalue，保证指针参数引用的 userdata 与 z/Z 字符串在调用期间存活 */
+    lua_createtable(L, nlua, 0);
+    for (int i = 1; i <= nlua; i++) {
+        lua_pushvalue(L, i + 1);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setiuservalue(L, handle, 1);
+
+    plan_to_c(L, plan, 2, job->args);
+
+    AsyncQueue* q = get_async_queue(L);
+    __atomic_add_fetch(&q->refcount, 1, __ATOMIC_ACQ_REL);
+    job->queue = q;
+    job->refcount = 2;
+    job->done = 0;
+    async_pin(L, job, handle);
+    if (!pool_submit(&__g_async_pool, async_worker, job))
+        async_worker(job);      // 无法使用线程池时同步执行
+
+    lua_settop(L, handle);
+    return 1;
+}
+
+static AsyncJob* check_async_call(lua_State* L, int idx) {
+    return *(AsyncJob**)luaL_checkudata(L, idx, "AsyncCall");
+}
+
+/* handle:done() -> boolean */
+static int asynccall_done(lua_State* L) {
+    AsyncJob* job = check_async_call(L, 1);
+    lua_pushboolean(L, __atomic_load_n(&job->done, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+/* handle:wait() -> 返回值：阻塞当前线程直到完成 */
+static int asynccall_wait(lua_State* L) {
+    AsyncJob* job = check_async_call(L, 1);
+    async_job_wait(job);
+    async_pin(L, job, 0);
+    return async_push_results(L, job);
+}
+
+/* handle:await() -> 返回值：在协程中未完成时让出（yield 该句柄），恢复后再次检查 */
+static int asynccall_await_k(lua_State* L, int status, lua_KContext ctx) {
+    (void)status;
+    AsyncJob* job = (AsyncJob*)ctx;
+    if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+        lua_settop(L, 1);
+        lua_pushvalue(L, 1);
+        return lua_yieldk(L, 1, ctx, asynccall_await_k);
+    }
+    lua_settop(L, 1);
+    async_pin(L, job, 0);
+    return async_push_results(L, job);
+}
+
+static int asynccall_await(lua_State* L) {
+    AsyncJob* job = check_async_call(L, 1);
+    lua_settop(L, 1);
+    if (!lua_isyieldable(L)) {
+        async_job_wait(job);        // 不在协程中时退化为 wait
+        async_pin(L, job, 0);
+        return async_push_results(L, job);
+    }
+    return asynccall_await_k(L, LUA_OK, (lua_KContext)job);
+}
+
+static int asynccall_gc(lua_State* L) {
+    AsyncJob** ud = (AsyncJob**)luaL_checkudata(L, 1, "AsyncCall");
+    if (!*ud) return 0;
+    async_job_wait(*ud);            // 仅在关闭 Lua 状态时可能仍未完成
+    async_job_release(*ud);
+    *ud = NULL;
+    return 0;
+}
+
+static int asynccall_tostring(lua_State* L) {
+    AsyncJob* job = check_async_call(L, 1);
+    lua_pushfstring(L, "AsyncCall(%s): %s", job->sig->text,
+                    __atomic_load_n(&job->done, __ATOMIC_ACQUIRE) ? "done" : "pending");
+    return 1;
+}
+
+/* ---------- LuaFFI.completed([max]) -> {handle, ...}：批量取出已完成且尚未取走的异步调用 ---------- */
+int completedAsyncCalls(lua_State* L) {
+    lua_Integer max = luaL_optinteger(L, 1, LUA_MAXINTEGER);
+    AsyncQueue* q = get_async_queue(L);
+
+    pthread_mutex_lock(&q->lock);
+    AsyncJob* list = q->head;
+    AsyncJob* last = NULL;
+    lua_Integer n = 0;
+    for (AsyncJob* job = list; job && n < max; job = job->next, n++) last = job;
+    if (last) {
+        q->head = last->next;
+        if (!q->head) q->tail = NULL;
+        last->next = NULL;
+    } else {
+        list = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    lua_createtable(L, (int)n, 0);
+    int i = 0;
+    if (lua_getfield(L, LUA_REGISTRYINDEX, "LuaFFI.AsyncPending") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+    }
+    while (list) {
+        AsyncJob* next = list->next;
+        if (lua_rawgetp(L, -1, list) != LUA_TNIL) {
+            lua_rawseti(L, -3, ++i);
+            lua_pushnil(L);
+            lua_rawsetp(L, -2, list);       // 已交付，解除登记
+        } else {
+            lua_pop(L, 1);                  // 已由 wait/await 取走
+        }
+        async_job_release(list);            // 完成队列持有的引用
+        list = next;
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+/* ---------- __gc 元方法 ---------- */
+static int nativefunction_gc(lua_State* L) {
+    NativeFunction** ud = (NativeFunction**)lua_touserdata(L, 1);
+    if (ud && *ud) {
+        NativeFunction* nf = *ud;
+        for (int i = 0; i < VAR_CACHE_SLOTS; i++)
+            if (nf->var_cache[i]) var_call_free(nf->var_cache[i]);
+        while (nf->var_typed) {
+            VarCall* next = nf->var_typed->next;
+            var_call_free(nf->var_typed);
+            nf->var_typed = next;
+        }
+        signature_release(nf->sig);   // 释放共享签名的引用
+        stats_free(nf->stats);
+        free(nf);
+        *ud = NULL;
+    }
+    return 0;
+}
+
+/* ---------- wrapNativeFunction 构造函数 ---------- */
+int wrapNativeFunction(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 2);
+    LUA_TYPE_ASSERT(L, lightuserdata, 1);
+
+    void* func_ptr = lua_touserdata(L, 1);
+    Signature* sig = check_signature(L, 2);
+    if (!sig->types[1]) {   // 确保至少有一个返回值和一个参数
+        signature_release(sig);
+        luaL_error(L, "LuaFFI: %s's signature need a ret-value and one argument at least", __func__);
+    }
+
+    /* ---------- 分配 NativeFunction ---------- */
+    NativeFunction* nf = calloc(1, sizeof(NativeFunction));
+    if (!nf) {
+        signature_release(sig);
+        luaL_error(L, "LuaFFI: %s failed to alloc mem", __func__);
+    }
+    nf->func_ptr = func_ptr;
+    nf->sig      = sig;            // 所有权转移，__gc 中释放
 
     /* ---------- 创建 full userdata ---------- */
     NativeFunction** ud = (NativeFunction**)lua_newuserdata(L, sizeof(NativeFunction*));
@@ -502,6 +1967,16 @@ int wrapNativeFunction(lua_State* L) {
         lua_setfield(L, -2, "__gc");
         lua_pushvalue(L, -1);
         lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, nativefunction_vcall);
+        lua_setfield(L, -2, "vcall");
+        lua_pushcfunction(L, nativefunction_batch);
+        lua_setfield(L, -2, "batch");
+        lua_pushcfunction(L, nativefunction_batch_into);
+        lua_setfield(L, -2, "batchInto");
+        lua_pushcfunction(L, nativefunction_return_views);
+        lua_setfield(L, -2, "returnViews");
+        lua_pushcfunction(L, nativefunction_async);
+        lua_setfield(L, -2, "async");
     }
     lua_setmetatable(L, -2);
 
@@ -509,11 +1984,102 @@ int wrapNativeFunction(lua_State* L) {
 }
 
 /* ---------- 闭包回调函数 ---------- */
+/* 闭包的标识：签名与栈顶 Lua 函数的定义位置 */
+static void closure_label(lua_State* L, Signature* sig, char* buf, size_t size) {
+    lua_Debug ar;
+    lua_pushvalue(L, -1);
+    lua_getinfo(L, ">S", &ar);
+    snprintf(buf, size, "%s %s:%d", sig->text, ar.short_src, ar.linedefined);
+}
+
+/* 开启统计时取得（必要时创建）闭包的统计项，栈顶为 Lua 函数 */
+static CallStats* closure_stats(lua_State* L, CallStats** slot, int kind, Signature* sig) {
+    CallStats* st = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (st) return st;
+    char label[256];
+    closure_label(L, sig, label, sizeof(label));
+    return stats_install(slot, stats_new(kind, label));
+}
+
+/* 开启追踪时记录闭包的进入事件，栈顶为 Lua 函数；返回是否需要记录退出事件 */
+static int closure_trace_enter(lua_State* L, const void* id, unsigned* epoch, int kind, Signature* sig) {
+    if (!trace_enabled()) return 0;
+    if (!trace_named(epoch)) {
+        char label[256];
+        closure_label(L, sig, label, sizeof(label));
+        trace_register(id, epoch, kind, label);
+    }
+    trace_emit(id, 'B');
+    return 1;
+}
+
+/* ---------- 跨线程调用：排入所属状态的队列，BLOCK 等待结果，POST 立即返回 ---------- */
+/* POST 事件中参数 i 需深拷贝的字符串字节数（z 含结尾 \0，非字符串参数为 0） */
+static size_t post_string_size(ffi_type* type, void** args, int i) {
+    const char* str = *(const char* const*)args[i];
+    if (!str) return 0;
+    if (type == &__ffi_type_string) return strlen(str) + 1;
+    if (type == &__ffi_type_lstring) return *(const size_t*)args[i + 1];
+    return 0;
+}
+
+static void closure_call_cross(LuaClosureInfo* info, void* ret, void** args) {
+    Signature* sig = info->sig;
+    int nargs = sig->nfixed;
+    __atomic_add_fetch(&info->refcount, 1, __ATOMIC_RELAXED);     // 事件持有，drain 执行后释放
+
+    if (info->cross == CROSS_BLOCK) {
+        /* 调用者阻塞期间 args 与 ret 均有效，事件放在本线程栈上 */
+        CallEvent ev = { .info = info, .args = args, .ret = ret, .blocking = 1 };
+        pthread_mutex_init(&ev.lock, NULL);
+        pthread_cond_init(&ev.cond, NULL);
+        call_queue_push(info->queue, &ev);
+        pthread_mutex_lock(&ev.lock);
+        while (!ev.done) pthread_cond_wait(&ev.cond, &ev.lock);
+        pthread_mutex_unlock(&ev.lock);
+        pthread_cond_destroy(&ev.cond);
+        pthread_mutex_destroy(&ev.lock);
+        return;
+    }
+
+    /* POST：参数按值拷贝进事件，z/Z 字符串一并深拷贝（调用者返回后原字符串可能失效），由 drain 执行后释放 */
+    const MarshalPlan* plan = &sig->args_plan;
+    size_t strings = 0;
+    for (int i = 0; i < nargs; i++)
+        strings += post_string_size(sig->arg_types[i], args, i);
+    CallEvent* ev = malloc(sizeof(CallEvent) + nargs * sizeof(void*) + plan->frame_size + SCRATCH_ALIGN + strings);
+    if (!ev) {
+        fprintf(stderr, "LuaFFI: out of memory, cross-thread callback dropped\n");
+        __atomic_sub_fetch(&info->refcount, 1, __ATOMIC_RELAXED);  // 不是最后一个引用：闭包仍在被调用
+        return;
+    }
+    memset(ev, 0, sizeof(CallEvent));
+    ev->info = info;
+    ev->args = (void**)(ev + 1);
+    char* frame = (char*)(((uintptr_t)(ev->args + nargs) + SCRATCH_ALIGN - 1) & ~(uintptr_t)(SCRATCH_ALIGN - 1));
+    char* copy = frame + plan->frame_size;
+    for (int i = 0; i < nargs; i++) {
+        ev->args[i] = frame + plan->arg_offsets[i];
+        memcpy(ev->args[i], args[i], sig->arg_types[i]->size);
+        size_t n = post_string_size(sig->arg_types[i], args, i);
+        if (n) {
+            memcpy(copy, *(const char* const*)args[i], n);
+            *(char**)ev->args[i] = copy;
+            copy += n;
+        }
+    }
+    call_queue_push(info->queue, ev);
+}
+
 static void lua_closure_callback(ffi_cif* cif, void* ret, void** args, void* user_data) {
     LuaClosureInfo* info = (LuaClosureInfo*)user_data;
 
     // 检查当前线程是否与创建闭包的线程一致
     if (!pthread_equal(pthread_self(), info->tid)) {
+        if (info->cross != CROSS_NONE) {
+            closure_call_cross(info, ret, args);
+            return;
+        }
         fprintf(stderr, "Fatal: Lua closure called from wrong thread "
                 "(expected %lu, got %lu)\n",
                 (unsigned long)info->tid, (unsigned long)pthread_self());
@@ -522,265 +2088,1249 @@ static void lua_closure_callback(ffi_cif* cif, void* ret, void** args, void* use
 
     lua_State* L = info->L;
     int top = lua_gettop(L);
+    Signature* sig = info->sig;
+    CallStats* st = NULL;
+    uint64_t t0 = 0, t1 = 0, t2 = 0;
+    if (stats_enabled()) t0 = stats_now();
 
     // 压入 Lua 函数
     lua_rawgeti(L, LUA_REGISTRYINDEX, info->func_ref);
+    if (t0) st = closure_stats(L, &info->stats, STATS_LUA, sig);
+    int traced = closure_trace_enter(L, info, &info->trace_epoch, TRACE_LUA, sig);
 
-    // 压入参数
-    for (int i = 0; i < info->nargs; i++) {
-        // 使用之前定义的 lua_push_cvalue（需已在项目中实现）
-        lua_push_cvalue(L, args[i], info->arg_types[i]);
-    }
+    // 按预编译计划压入参数
+    plan_to_lua(L, &sig->args_plan, args);
 
     // 调用 Lua 函数
-    if (lua_pcall(L, info->nargs, 1, 0) != LUA_OK) {
+    if (st) t1 = stats_now();
+    if (lua_pcall(L, sig->args_plan.nlua, 1, 0) != LUA_OK) {
         const char* err = lua_tostring(L, -1);
         fprintf(stderr, "Lua closure error: %s\n", err);
         lua_error(L);   // 抛出错误（longjmp）
         return;         // 不会执行到这里
     }
 
-    // 处理返回值
-    if (info->ret_type->type != FFI_TYPE_VOID) {
-        lua_to_cvalue(L, -1, info->ret_type, ret);      // 直接写入 ret 指向的内存
+    if (st) t2 = stats_now();
+
+    // 处理返回值
+    if (sig->ret_type->type != FFI_TYPE_VOID) {
+        plan_to_c(L, &sig->ret_plan, lua_gettop(L), &ret);      // 直接写入 ret 指向的内存
+        lua_pop(L, 1);
+    }
+
+    // 恢复栈
+    lua_settop(L, top);
+    if (st) stats_record(st, t0, t1, t2, stats_now());
+    if (traced) trace_emit(info, 'E');
+}
+
+/* ---------- wrapLuaFunction ---------- */
+/* 读取 wrapLua/wrapLuaMT 的选项表 {managed = true} */
+static int closure_opts_managed(lua_State* L, int idx) {
+    if (lua_isnoneornil(L, idx)) return 0;
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_getfield(L, idx, "managed");
+    int managed = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return managed;
+}
+
+/* 读取选项表中的 crossThread = "block" | "post" */
+static int closure_opts_cross(lua_State* L, int idx) {
+    if (lua_isnoneornil(L, idx)) return CROSS_NONE;
+    lua_getfield(L, idx, "crossThread");
+    const char* mode = lua_tostring(L, -1);
+    int cross = CROSS_NONE;
+    if (mode && strcmp(mode, "block") == 0) cross = CROSS_BLOCK;
+    else if (mode && strcmp(mode, "post") == 0) cross = CROSS_POST;
+    else if (!lua_isnil(L, -1)) luaL_error(L, "LuaFFI: crossThread must be \"block\" or \"post\"");
+    lua_pop(L, 1);
+    return cross;
+}
+
+/* 取得（必要时创建）该 Lua 状态的跨线程调用队列，存放在注册表中 */
+static CallQueue* get_call_queue(lua_State* L) {
+    if (lua_getfield(L, LUA_REGISTRYINDEX, "LuaFFI.CallQueue") == LUA_TUSERDATA) {
+        CallQueue* q = (CallQueue*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return q;
+    }
+    lua_pop(L, 1);
+    CallQueue* q = (CallQueue*)lua_newuserdatauv(L, sizeof(CallQueue), 0);
+    call_queue_init(q);
+    luaL_setmetatable(L, "CallQueue");
+    lua_setfield(L, LUA_REGISTRYINDEX, "LuaFFI.CallQueue");
+    return q;
+}
+
+static int callqueue_gc(lua_State* L) {
+    CallQueue* q = (CallQueue*)lua_touserdata(L, 1);
+    if (q->efd >= 0) close(q->efd);
+    q->efd = -1;
+    return 0;
+}
+
+/* 在保护模式下执行一个排队的调用（栈上为事件 lightuserdata） */
+static void lua_closure_release(LuaClosureInfo* info);
+
+static int drain_one(lua_State* L) {
+    CallEvent* ev = (CallEvent*)lua_touserdata(L, 1);
+    LuaClosureInfo* info = ev->info;
+    Signature* sig = info->sig;
+
+    CallStats* st = NULL;
+    uint64_t t0 = 0, t1 = 0, t2 = 0;
+    if (stats_enabled()) t0 = stats_now();
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, info->func_ref);
+    if (t0) st = closure_stats(L, &info->stats, STATS_LUA, sig);
+    int traced = closure_trace_enter(L, info, &info->trace_epoch, TRACE_LUA, sig);
+    plan_to_lua(L, &sig->args_plan, ev->args);
+    if (st) t1 = stats_now();
+    lua_call(L, sig->args_plan.nlua, 1);
+    if (st) t2 = stats_now();
+    if (ev->blocking && sig->ret_type->type != FFI_TYPE_VOID)
+        plan_to_c(L, &sig->ret_plan, lua_gettop(L), &ev->ret);
+    if (st) stats_record(st, t0, t1, t2, stats_now());
+    if (traced) trace_emit(info, 'E');
+    return 0;
+}
+
+/* ---------- LuaFFI.drain([maxEvents]) -> n：在所属线程执行排队的跨线程回调 ---------- */
+int drainCallbacks(lua_State* L) {
+    lua_Integer max = luaL_optinteger(L, 1, LUA_MAXINTEGER);
+    CallQueue* q = get_call_queue(L);
+
+    if (q->efd >= 0) {
+        uint64_t v;
+        ssize_t r = read(q->efd, &v, sizeof(v));   // 非阻塞，清除唤醒计数
+        (void)r;
+    }
+    __atomic_store_n(&q->pending, 0, __ATOMIC_RELEASE);
+
+    lua_Integer n = 0;
+    CallEvent* ev;
+    while (n < max && (ev = call_queue_pop(q))) {
+        LuaClosureInfo* info = ev->info;       // BLOCK 事件在唤醒调用者后即失效
+        lua_pushcfunction(L, drain_one);
+        lua_pushlightuserdata(L, ev);
+        if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+            fprintf(stderr, "Lua closure error: %s\n", lua_tostring(L, -1));
+            if (ev->blocking) memset(ev->ret, 0, ev->info->sig->ret_size);
+            lua_pop(L, 1);
+        }
+        if (ev->blocking) {
+            pthread_mutex_lock(&ev->lock);
+            ev->done = 1;
+            pthread_cond_signal(&ev->cond);
+            pthread_mutex_unlock(&ev->lock);
+        } else {
+            free(ev);
+        }
+        lua_closure_release(info);              // 事件持有的引用
+        n++;
+    }
+
+    /* 达到上限仍有剩余时重新触发唤醒 */
+    if (n == max && q->efd >= 0 && __atomic_exchange_n(&q->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint64_t one = 1;
+        ssize_t r = write(q->efd, &one, sizeof(one));
+        (void)r;
+    }
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/* ---------- LuaFFI.eventfd() -> fd：有跨线程回调排队时变为可读，可接入事件循环 ---------- */
+int callQueueEventFd(lua_State* L) {
+    lua_pushinteger(L, get_call_queue(L)->efd);
+    return 1;
+}
+
+/* 以 lightuserdata 或 LuaClosure 句柄返回可执行地址 */
+static void push_closure_code(lua_State* L, void* code, int managed, int mt) {
+    if (!managed) {
+        lua_pushlightuserdata(L, code);
+        return;
+    }
+    LuaClosureHandle* h = (LuaClosureHandle*)lua_newuserdatauv(L, sizeof(LuaClosureHandle), 0);
+    h->code = code;
+    h->mt = mt;
+    luaL_setmetatable(L, "LuaClosure");
+}
+
+/* 取 unwrap 参数中的可执行地址；句柄会被标记为已释放，避免 __gc 再次释放 */
+static void* take_closure_code(lua_State* L, int idx, int mt) {
+    LuaClosureHandle* h = (LuaClosureHandle*)luaL_testudata(L, idx, "LuaClosure");
+    if (h) {
+        if (h->mt != mt)
+            luaL_error(L, "LuaFFI: closure handle belongs to %s", h->mt ? "unwrapLuaMT" : "unwrapLua");
+        void* code = h->code;
+        h->code = NULL;
+        return code;
+    }
+    if (!lua_islightuserdata(L, idx))
+        luaL_error(L, "LuaFFI: unwrap expects a lightuserdata or LuaClosure");
+    return lua_touserdata(L, idx);
+}
+
+/* 释放一个引用：解除包装与排队的跨线程调用执行完毕时调用（均在所属线程），最后一个引用释放闭包资源 */
+static void lua_closure_release(LuaClosureInfo* info) {
+    if (__atomic_sub_fetch(&info->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    luaL_unref(info->L, LUA_REGISTRYINDEX, info->func_ref);   // 释放 Lua 函数引用
+    signature_release(info->sig);                               // 释放签名句柄
+    stats_free(info->stats);                                    // 注销调用统计
+    info->stats = NULL;
+    closure_slot_release(container_of(info, ClosureSlot, info.lua));
+}
+
+int wrapLuaFunction(lua_State* L) {
+    int argc = lua_gettop(L);
+    if (argc != 2 && argc != 3)
+        luaL_error(L, "LuaFFI: %s expected 2 or 3 arguments", __func__);
+    LUA_TYPE_ASSERT(L, string, 1);
+    int managed = closure_opts_managed(L, 3);
+    int cross = closure_opts_cross(L, 3);
+    CallQueue* queue = cross != CROSS_NONE ? get_call_queue(L) : NULL;
+
+    const char* func_name = lua_tostring(L, 1);
+
+    // 1. 获取 Lua 函数
+    lua_getglobal(L, func_name);
+    if (!lua_isfunction(L, -1)) {
+        luaL_error(L, "LuaFFI: %s is not a function", func_name);
+    }
+
+    // 2. 获取驻留的签名句柄（closure 不支持可变参数）
+    Signature* sig = check_signature(L, 2);
+    if (sig->is_variadic) {
+        signature_release(sig);
+        luaL_error(L, "LuaFFI: variadic arguments not supported in closure");
+    }
+    if (sig->ret_type == &__ffi_type_string) {
+        signature_release(sig);
+        luaL_error(L, "LuaFFI: z return type not supported in closure (the string would not outlive the call)");
+    }
+    if (sig->out_plan.nlua) {
+        signature_release(sig);
+        luaL_error(L, "LuaFFI: out-parameters (& / *) not supported in closure");
+    }
+    if (cross == CROSS_POST && sig->ret_type->type != FFI_TYPE_VOID) {
+        signature_release(sig);
+        luaL_error(L, "LuaFFI: crossThread \"post\" requires a void return type");
+    }
+
+    // 3. 从池中取出槽位（含 closure 与 LuaClosureInfo）
+    ClosureSlot* slot = closure_slot_acquire();
+    if (!slot) {
+        signature_release(sig);
+        luaL_error(L, "LuaFFI: ffi_closure_alloc failed");
+    }
+    LuaClosureInfo* info = &slot->info.lua;
+    info->L = L;
+    info->sig = sig;
+    info->tid = pthread_self();   // 记录创建线程
+    info->writable = slot->writable;
+    info->cross = cross;
+    info->queue = queue;
+    info->stats = NULL;
+    info->trace_epoch = 0;
+    info->refcount = 1;
+
+    // 4. 获取函数引用（存入注册表）
+    lua_pushvalue(L, -1);               // 复制函数
+    info->func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);                       // 弹出原始函数
+
+    // 5. 准备 closure（cif 由签名句柄预先生成，只写入蹦床，不映射新页）
+    void* code = slot->code;
+    ffi_status status = ffi_prep_closure_loc(slot->writable, &sig->cif, lua_closure_callback,
+                                             info, code);
+    if (status != FFI_OK) {
+        lua_closure_release(info);
+        luaL_error(L, "LuaFFI: ffi_prep_closure_loc failed");
+    }
+
+    // 6. 插入映射
+    if (!registry_insert(&__g_closures, code, info)) {
+        lua_closure_release(info);
+        luaL_error(L, "LuaFFI: out of memory");
+    }
+
+    // 7. 返回可执行地址
+    push_closure_code(L, code, managed, 0);
+    return 1;
+}
+
+/* ---------- unwrapLuaFunction ---------- */
+int unwrapLuaFunction(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 1);
+    void* code = take_closure_code(L, 1, 0);
+
+    LuaClosureInfo* info = registry_take(&__g_closures, code);
+    if (!info) return 0;   // 未找到，可能已释放
+
+    lua_closure_release(info);
+    return 0;
+}
+
+int getString(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 1);
+    LUA_TYPE_ASSERT(L, lightuserdata, 1);
+    void* ptr = lua_touserdata(L, 1);
+    if (!ptr) {
+        lua_pushnil(L);
+        return 1;
+    }
+    const char* str = (const char*)ptr;
+    lua_pushstring(L, str);
+    return 1;
+}
+
+/* 取 idx 处的地址参数：lightuserdata、full userdata、视图或映射文件 */
+static const char* check_address(lua_State* L, int idx) {
+    int t = lua_type(L, idx);
+    if (t != LUA_TLIGHTUSERDATA && t != LUA_TUSERDATA)
+        luaL_error(L, "LuaFFI: argument %d needs a pointer", idx);
+    const char* ptr;
+    to_c_pointer(L, idx, &ptr);
+    return ptr;
+}
+
+/* ---------- LuaFFI.getLString(ptr, len)：读取 len 字节（可含 \0），ptr 为 NULL 时返回 nil ---------- */
+int getLString(lua_State* L) {
+    const char* ptr = check_address(L, 1);
+    lua_Integer len = luaL_checkinteger(L, 2);
+    if (len < 0) luaL_error(L, "LuaFFI: bad length %d", (int)len);
+    if (!ptr) lua_pushnil(L);
+    else lua_pushlstring(L, ptr, (size_t)len);
+    return 1;
+}
+
+/* ---------- LuaFFI.getStringN(ptr, maxlen)：最多读取 maxlen 字节，遇到 \0 提前结束 ---------- */
+int getStringN(lua_State* L) {
+    const char* ptr = check_address(L, 1);
+    lua_Integer max = luaL_checkinteger(L, 2);
+    if (max < 0) luaL_error(L, "LuaFFI: bad length %d", (int)max);
+    if (!ptr) lua_pushnil(L);
+    else lua_pushlstring(L, ptr, strnlen(ptr, (size_t)max));
+    return 1;
+}
+
+/* ---------- LuaFFI.getStrings(ptr, n[, into[, maxlen]])：一次读取 char* 数组 ----------
+ * n 为 nil 时读到 NULL 元素为止（argv 风格）；指定 n 时 NULL 元素记为 false，保持数组连续 */
+int getStrings(lua_State* L) {
+    const char* const* arr = (const char* const*)check_address(L, 1);
+    int bounded = !lua_isnoneornil(L, 2);
+    lua_Integer n = bounded ? luaL_checkinteger(L, 2) : 0;
+    size_t max = (size_t)luaL_optinteger(L, 4, -1);     // 省略时不限长度
+    if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+    if (n < 0) n = 0;
+    if (!arr && (!bounded || n > 0)) luaL_error(L, "LuaFFI: getStrings needs a pointer");
+    if (!bounded) while (arr[n]) n++;
+
+    lua_settop(L, 3);
+    if (lua_isnil(L, 3)) {
+        lua_createtable(L, (int)n, 0);
+        lua_replace(L, 3);
+    }
+    for (lua_Integer i = 0; i < n; i++) {
+        const char* str = arr[i];
+        if (!str) lua_pushboolean(L, 0);
+        else if (max == (size_t)-1) lua_pushstring(L, str);
+        else lua_pushlstring(L, str, strnlen(str, max));
+        lua_rawseti(L, 3, i + 1);
+    }
+    return 1;
+}
+
+/* ---------- 结构体数组批量打包/解包：按元素编组计划在一个 C 循环内转换 ---------- */
+/* 取结构体 name 的单元素签名（驻留，结构体重新注册后自动重建），句柄压栈以在出错时释放引用 */
+static Signature* struct_array_signature(lua_State* L, int idx) {
+    const char* name = lua_tostring(L, idx);
+    if (strchr(name, '|')) luaL_error(L, "LuaFFI: unknown structure %s", name);
+    Signature** ud = (Signature**)lua_newuserdata(L, sizeof(Signature*));
+    *ud = NULL;
+    luaL_setmetatable(L, "Signature");
+    const char* err = NULL;
+    Signature* sig = signature_intern(lua_pushfstring(L, "v|%s|", name), &err);
+    lua_pop(L, 1);
+    if (!sig) luaL_error(L, "LuaFFI: %s", err);
+    *ud = sig;
+    if (sig->nfixed != 1 || sig->arg_types[0]->type != FFI_TYPE_STRUCT)
+        luaL_error(L, "LuaFFI: unknown structure %s", name);
+    return sig;
+}
+
+/* 栈顶表中键为 name（或序号 field）的子表压栈，不存在时新建（由调用方写回） */
+static void push_reused_table(lua_State* L, const char* name, lua_Integer field, int narr, int nrec) {
+    int t = name ? lua_getfield(L, -1, name) : lua_rawgeti(L, -1, field);
+    if (t != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_createtable(L, narr, nrec);
+    }
+}
+
+/* 将结构体 C 值写入栈顶的表，复用已有的子表（计划之外的冷路径：结构体元素的数组） */
+static void fill_c_value(lua_State* L, ffi_type* type, const char* ptr) {
+    Structure* st = get_structure(type);
+    luaL_checkstack(L, 2, "LuaFFI: structure nested too deep");
+    for (int i = 0; i < st->nfields; i++) {
+        ffi_type* ft = struct_field_type(st, i);
+        const char* name = st->field_names ? st->field_names[i] : NULL;
+        if (ft->type == FFI_TYPE_STRUCT) {
+            Structure* sub = get_structure(ft);
+            push_reused_table(L, name, i + 1, sub->field_names ? 0 : sub->nfields,
+                              sub->field_names ? sub->nfields : 0);
+            fill_c_value(L, ft, ptr + struct_field_offset(st, i));
+        } else {
+            push_c_value(L, ft, ptr + struct_field_offset(st, i));
+        }
+        if (name) lua_setfield(L, -2, name);
+        else lua_rawseti(L, -2, i + 1);
+    }
+}
+
+/* 按计划将 argv[0] 处的结构体写入栈顶的表，嵌套结构体与数组复用表中已有的子表 */
+static void plan_fill_lua(lua_State* L, const MarshalPlan* plan, void** argv) {
+    const MarshalStep* step = plan->steps;
+    const MarshalStep* end = step + plan->nsteps;
+    for (; step < end; step++) {
+        const char* in = (const char*)argv[step->arg] + step->offset;
+        switch (step->kind) {
+            case STEP_LEAF:
+                step->to_lua(L, in);
+                if (step->name) lua_setfield(L, -2, step->name);
+                else lua_rawseti(L, -2, step->field);
+                break;
+            case STEP_ENTER:
+                if (step->field == 0) break;            // 顶层：目标表已在栈顶
+                if (get_structure(step->type)->field_names)
+                    push_reused_table(L, step->name, step->field, 0, step->nfields);
+                else
+                    push_reused_table(L, step->name, step->field, step->nfields, 0);
+                break;
+            case STEP_LEAVE:
+                if (step->field == 0) break;
+                if (step->name) lua_setfield(L, -2, step->name);
+                else lua_rawseti(L, -2, step->field);
+                break;
+            case STEP_ARRAY: {
+                if (step->field) push_reused_table(L, step->name, step->field, step->nfields, 0);
+                ffi_type* elem = get_structure(step->type)->elem;
+                for (int i = 1; i <= step->nfields; i++, in += step->stride) {
+                    if (step->to_lua) {
+                        step->to_lua(L, in);
+                    } else {
+                        Structure* sub = get_structure(elem);
+                        push_reused_table(L, NULL, i, sub->field_names ? 0 : sub->nfields,
+                                          sub->field_names ? sub->nfields : 0);
+                        fill_c_value(L, elem, in);
+                    }
+                    lua_rawseti(L, -2, i);
+                }
+                if (step->field == 0) break;
+                if (step->name) lua_setfield(L, -2, step->name);
+                else lua_rawseti(L, -2, step->field);
+                break;
+            }
+        }
+    }
+}
+
+/* ---------- LuaFFI.pack(name, array[, into]) -> buffer, n：打包为连续的结构体数组 ---------- */
+int packStructArray(lua_State* L) {
+    LUA_TYPE_ASSERT(L, string, 1);
+    LUA_TYPE_ASSERT(L, table, 2);
+    lua_settop(L, 3);
+    Signature* sig = struct_array_signature(L, 1);          // 位于栈槽 4
+    size_t size = sig->arg_types[0]->size;
+    lua_Integer n = (lua_Integer)lua_rawlen(L, 2);
+    if (n > 0 && (size_t)n > SIZE_MAX / size) luaL_error(L, "LuaFFI: pack array too large");
+
+    char* buf;
+    if (lua_isnil(L, 3)) {
+        buf = (char*)lua_newuserdatauv(L, n ? (size_t)n * size : 1, 0);
+        lua_replace(L, 3);
+    } else {
+        size_t capacity;
+        buf = to_c_buffer(L, 3, &capacity);
+        if (!buf) luaL_error(L, "LuaFFI: pack needs a userdata buffer");
+        if (capacity < (size_t)n * size)
+            luaL_error(L, "LuaFFI: pack buffer of %d bytes is too small for %d elements",
+                       (int)capacity, (int)n);
+    }
+
+    const MarshalPlan* plan = &sig->args_plan;
+    void* argv[1];
+    for (lua_Integer i = 1; i <= n; i++) {
+        argv[0] = buf + (size_t)(i - 1) * size;
+        lua_rawgeti(L, 2, i);
+        plan_to_c(L, plan, lua_gettop(L), argv);
         lua_pop(L, 1);
     }
-
-    // 恢复栈
-    lua_settop(L, top);
+    lua_settop(L, 3);
+    lua_pushinteger(L, n);
+    return 2;
 }
 
-/* ---------- wrapLuaFunction ---------- */
-int wrapLuaFunction(lua_State* L) {
-    LUA_ARGC_ASSERT(L, 2);
+/* ---------- LuaFFI.unpack(name, ptr, n[, into]) -> array：解包连续的结构体数组 ---------- */
+int unpackStructArray(lua_State* L) {
     LUA_TYPE_ASSERT(L, string, 1);
-    LUA_TYPE_ASSERT(L, string, 2);
+    lua_Integer n = luaL_checkinteger(L, 3);
+    lua_settop(L, 4);
+    size_t capacity;
+    char* buf = to_c_buffer(L, 2, &capacity);
+    if (!buf && n > 0) luaL_error(L, "LuaFFI: unpack needs a pointer");
+    if (n < 0) n = 0;
+    Signature* sig = struct_array_signature(L, 1);
+    size_t size = sig->arg_types[0]->size;
+    if ((size_t)n > capacity / size)
+        luaL_error(L, "LuaFFI: unpack buffer of %d bytes is too small for %d elements",
+                   (int)capacity, (int)n);
+    Structure* st = get_structure(sig->arg_types[0]);
+
+    if (lua_isnil(L, 4)) {
+        lua_createtable(L, (int)n, 0);
+        lua_replace(L, 4);
+    } else {
+        luaL_checktype(L, 4, LUA_TTABLE);
+    }
+    lua_pushvalue(L, 4);
+    luaL_checkstack(L, sig->args_plan.depth + 3, "LuaFFI: structure nested too deep");
+
+    /* 目标表中已有的元素表被复用，只覆盖字段 */
+    int narr = st->field_names ? 0 : st->nfields;
+    int nrec = st->field_names ? st->nfields : 0;
+    const MarshalPlan* plan = &sig->args_plan;
+    void* argv[1];
+    for (lua_Integer i = 1; i <= n; i++) {
+        argv[0] = buf + (size_t)(i - 1) * size;
+        push_reused_table(L, NULL, i, narr, nrec);
+        plan_fill_lua(L, plan, argv);
+        lua_rawseti(L, -2, i);
+    }
+    lua_pushvalue(L, 4);
+    return 1;
+}
 
-    const char* func_name = lua_tostring(L, 1);
-    const char* sign = lua_tostring(L, 2);
+/* ---------- 内存映射文件：记录以借用的 StructView 访问，字段按偏移就地读写 ---------- */
+static MappedFile* check_mapped_file(lua_State* L, int idx) {
+    MappedFile* m = (MappedFile*)luaL_checkudata(L, idx, "MappedFile");
+    if (m->closed) luaL_error(L, "LuaFFI: MappedFile is closed");
+    return m;
+}
 
-    // 1. 获取 Lua 函数
-    lua_getglobal(L, func_name);
-    if (!lua_isfunction(L, -1)) {
-        luaL_error(L, "LuaFFI: %s is not a function", func_name);
-    }
+/* 取 1 起的记录序号，越界返回 0 */
+static size_t mapped_file_record(lua_State* L, MappedFile* m, int idx) {
+    int isnum = 0;
+    lua_Integer i = lua_tointegerx(L, idx, &isnum);
+    if (!isnum || i < 1 || (lua_Unsigned)i > m->count) return 0;
+    return (size_t)i;
+}
 
-    // 2. 解析签名
-    ffi_type** sign_types = parse_string_fsm(sign);
-    if (!sign_types || !sign_types[0]) {
-        free(sign_types);
-        luaL_error(L, "LuaFFI: invalid signature (missing return type)");
+/* ---------- LuaFFI.mapFile(path, name[, mode]) -> MappedFile ---------- */
+int mapFile(lua_State* L) {
+    LUA_TYPE_ASSERT(L, string, 1);
+    LUA_TYPE_ASSERT(L, string, 2);
+    const char* path = lua_tostring(L, 1);
+    const char* name = lua_tostring(L, 2);
+    const char* mode = luaL_optstring(L, 3, "r");
+    if (strcmp(mode, "r") != 0 && strcmp(mode, "w") != 0)
+        luaL_error(L, "LuaFFI: mapFile mode must be \"r\" or \"w\"");
+
+    /* 先创建句柄并由其持有类型引用与映射，后续出错时由 __gc 释放 */
+    MappedFile* m = (MappedFile*)lua_newuserdatauv(L, sizeof(MappedFile), 0);
+    memset(m, 0, sizeof(MappedFile));
+    luaL_setmetatable(L, "MappedFile");
+    m->st = STRUCTMAP_ACQUIRE(name);
+    if (!m->st) luaL_error(L, "LuaFFI: unknown structure %s", name);
+    m->stride = m->st->type.size;
+    m->writable = mode[0] == 'w';
+
+    int fd = open(path, m->writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) luaL_error(L, "LuaFFI: cannot open %s", path);
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        close(fd);
+        luaL_error(L, "LuaFFI: cannot stat %s", path);
     }
-    // 检查可变参数标记（closure 不支持）
-    for (int i = 1; sign_types[i] != NULL; i++) {
-        if (sign_types[i] == (ffi_type*)VARIABLE) {
-            free(sign_types);
-            luaL_error(L, "LuaFFI: variadic arguments not supported in closure");
+    m->length = (size_t)sb.st_size;
+    m->count = m->stride ? m->length / m->stride : 0;    // 末尾不完整的记录不计入
+    if (m->length > 0) {
+        /* "r" 为私有映射：写入只修改本进程的副本，不会因只读页崩溃，也不会写回文件 */
+        void* base = mmap(NULL, m->length, PROT_READ | PROT_WRITE,
+                          m->writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            m->length = 0;
+            luaL_error(L, "LuaFFI: cannot map %s", path);
         }
+        m->base = (char*)base;
     }
+    close(fd);
+    return 1;
+}
 
-    // 3. 计算参数个数
-    int nargs = 0;
-    while (sign_types[nargs + 1] != NULL) nargs++;
-
-    // 4. 分配 LuaClosureInfo
-    LuaClosureInfo* info = malloc(sizeof(LuaClosureInfo));
-    if (!info) {
-        free(sign_types);
-        luaL_error(L, "LuaFFI: out of memory");
+/* m[i] 返回第 i 条记录的借用视图（越界为 nil），其余键为方法 */
+static int mappedfile_index(lua_State* L) {
+    MappedFile* m = (MappedFile*)luaL_checkudata(L, 1, "MappedFile");
+    if (lua_type(L, 2) != LUA_TNUMBER) {
+        luaL_getmetatable(L, "MappedFile");
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        return 1;
     }
-    info->L = L;
-    info->sign_base = sign_types;
-    info->ret_type = sign_types[0];
-    info->arg_types = sign_types + 1;
-    info->nargs = nargs;
-    info->tid = pthread_self();   // 记录创建线程
+    if (m->closed) luaL_error(L, "LuaFFI: MappedFile is closed");
+    size_t i = mapped_file_record(L, m, 2);
+    if (!i) {
+        lua_pushnil(L);
+        return 1;
+    }
+    push_borrowed_view(L, m->st, m->base + (i - 1) * m->stride, 1);
+    return 1;
+}
 
-    // 5. 获取函数引用（存入注册表）
-    lua_pushvalue(L, -1);               // 复制函数
-    info->func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    lua_pop(L, 1);                       // 弹出原始函数
+/* m[i] = value 以表、同类型视图覆盖第 i 条记录 */
+static int mappedfile_newindex(lua_State* L) {
+    MappedFile* m = check_mapped_file(L, 1);
+    size_t i = mapped_file_record(L, m, 2);
+    if (!i) luaL_error(L, "LuaFFI: MappedFile has no record %s", luaL_tolstring(L, 2, NULL));
+    store_field_value(L, 3, &m->st->type, m->base + (i - 1) * m->stride);
+    return 0;
+}
 
-    // 6. 分配 closure
-    void* code;
-    ffi_closure* closure = ffi_closure_alloc(sizeof(ffi_closure), &code);
-    if (!closure) {
-        luaL_unref(L, LUA_REGISTRYINDEX, info->func_ref);
-        free(sign_types);
-        free(info);
-        luaL_error(L, "LuaFFI: ffi_closure_alloc failed");
-    }
-    info->writable = closure;
+static int mappedfile_len(lua_State* L) {
+    MappedFile* m = (MappedFile*)luaL_checkudata(L, 1, "MappedFile");
+    lua_pushinteger(L, m->closed ? 0 : (lua_Integer)m->count);
+    return 1;
+}
 
-    // 7. 准备 ffi_cif
-    ffi_status status = ffi_prep_cif(&info->cif, FFI_DEFAULT_ABI, nargs,
-                                  info->ret_type, info->arg_types);
-    if (status != FFI_OK) {
-        luaL_unref(L, LUA_REGISTRYINDEX, info->func_ref);
-        ffi_closure_free(closure);
-        free(sign_types);
-        free(info);
-        luaL_error(L, "LuaFFI: ffi_prep_cif failed");
-    }
+/* 迭代器：上值 1 为复用的视图，上值 2 为最后一条记录的序号 */
+static int mappedfile_next(lua_State* L) {
+    MappedFile* m = check_mapped_file(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2) + 1;
+    if (i > lua_tointeger(L, lua_upvalueindex(2)) || (lua_Unsigned)i > m->count) return 0;
+    StructView* v = (StructView*)lua_touserdata(L, lua_upvalueindex(1));
+    v->ptr = m->base + (size_t)(i - 1) * m->stride;
+    lua_pushinteger(L, i);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    return 2;
+}
 
-    // 8. 准备 closure
-    status = ffi_prep_closure_loc(closure, &info->cif, lua_closure_callback,
-                                   info, code);
-    if (status != FFI_OK) {
-        luaL_unref(L, LUA_REGISTRYINDEX, info->func_ref);
-        ffi_closure_free(closure);
-        free(sign_types);
-        free(info);
-        luaL_error(L, "LuaFFI: ffi_prep_closure_loc failed");
+/* ---------- m:records([first[, last]])：for i, rec in ...，rec 为每步重新指向的同一个视图 ---------- */
+static int mappedfile_records(lua_State* L) {
+    MappedFile* m = check_mapped_file(L, 1);
+    lua_Integer first = luaL_optinteger(L, 2, 1);
+    lua_Integer last = luaL_optinteger(L, 3, (lua_Integer)m->count);
+    if (first < 1) first = 1;
+    push_borrowed_view(L, m->st, m->base, 1);
+    lua_pushinteger(L, last);
+    lua_pushcclosure(L, mappedfile_next, 2);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, first - 1);
+    return 3;
+}
+
+/* ---------- m:advise(hint[, first, last]) -> ok：按记录范围提示访问模式 ---------- */
+static int mappedfile_advise(lua_State* L) {
+    static const char* const hints[] = { "normal", "sequential", "random", "willneed", "dontneed", NULL };
+    static const int advice[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED };
+    MappedFile* m = check_mapped_file(L, 1);
+    int hint = luaL_checkoption(L, 2, NULL, hints);
+    lua_Integer first = luaL_optinteger(L, 3, 1);
+    lua_Integer last = luaL_optinteger(L, 4, (lua_Integer)m->count);
+    if (first < 1) first = 1;
+    if ((lua_Unsigned)last > m->count) last = (lua_Integer)m->count;
+    if (!m->base || first > last) {
+        lua_pushboolean(L, 1);
+        return 1;
     }
+    /* madvise 要求起始地址按页对齐 */
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = (size_t)(first - 1) * m->stride;
+    size_t end = (size_t)last * m->stride;
+    begin &= ~(page - 1);
+    lua_pushboolean(L, madvise(m->base + begin, end - begin, advice[hint]) == 0);
+    return 1;
+}
+
+/* ---------- m:close()：立即解除文件映射 ----------
+ * 原地址换成匿名零页，已取出的视图读到 0 而不会访问失效内存，地址空间在 __gc 时归还 */
+static int mappedfile_close(lua_State* L) {
+    MappedFile* m = (MappedFile*)luaL_checkudata(L, 1, "MappedFile");
+    if (m->closed) return 0;
+    m->closed = 1;
+    /* 替换失败时保留原映射，由 __gc 解除 */
+    if (m->base)
+        (void)mmap(m->base, m->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    return 0;
+}
 
-    // 9. 插入映射
-    map_insert(code, info);
+static int mappedfile_gc(lua_State* L) {
+    MappedFile* m = (MappedFile*)luaL_checkudata(L, 1, "MappedFile");
+    if (m->base) munmap(m->base, m->length);
+    m->base = NULL;
+    m->closed = 1;
+    structure_release(m->st);
+    m->st = NULL;
+    return 0;
+}
 
-    // 10. 返回 lightuserdata（可执行地址）
-    lua_pushlightuserdata(L, code);
+static int mappedfile_tostring(lua_State* L) {
+    MappedFile* m = (MappedFile*)luaL_checkudata(L, 1, "MappedFile");
+    lua_pushfstring(L, "MappedFile(%s x %d%s): %p", m->st ? m->st->name : "?", (int)m->count,
+                    m->closed ? ", closed" : "", m->base);
     return 1;
 }
 
-/* ---------- unwrapLuaFunction ---------- */
-int unwrapLuaFunction(lua_State* L) {
-    LUA_ARGC_ASSERT(L, 1);
-    LUA_TYPE_ASSERT(L, lightuserdata, 1);
-    void* code = lua_touserdata(L, 1);
+/* ---------- 并行 map/reduce：在工作线程池上逐元素调用 NativeFunction ---------- */
+typedef struct ParallelJob {
+    ffi_cif*    cif;
+    void*       fn;
+    ffi_type*   ret_type;       // 返回类型，用于截断 ffi_arg 扩展后的整数返回值
+    const char* in;             // 输入缓冲区
+    char*       out;            // map：输出缓冲区；reduce：每块的部分结果
+    size_t      in_stride;      // 输入元素大小
+    size_t      out_stride;     // 输出元素大小
+    size_t      ret_size;       // ffi_call 返回值缓冲区大小
+    size_t      n;              // 元素个数
+    size_t      chunk;          // 每块元素个数
+    size_t      nchunks;        // 块数
+    int         reduce;         // 是否为 reduce
+    uint64_t*   ranges;         // 每个参与者的待处理块区间 [lo, hi)，打包为 lo << 32 | hi
+    int         nranges;        // 参与者个数
+    int         next_worker;    // 下一个工作者编号（原子递增）
+    int         pending;        // 尚未结束的工作者数
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+} ParallelJob;
+
+#define RANGE_PACK(lo, hi) (((uint64_t)(lo) << 32) | (uint32_t)(hi))
+#define RANGE_LO(r)        ((uint32_t)((r) >> 32))
+#define RANGE_HI(r)        ((uint32_t)(r))
+
+/* 从自己区间的前端取一块；区间为空返回 0 */
+static int range_pop(uint64_t* slot, size_t* k) {
+    uint64_t r = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    while (RANGE_LO(r) < RANGE_HI(r)) {
+        if (__atomic_compare_exchange_n(slot, &r, RANGE_PACK(RANGE_LO(r) + 1, RANGE_HI(r)),
+                                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *k = RANGE_LO(r);
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    LuaClosureInfo* info = map_find(code);
-    if (!info) return 0;   // 未找到，可能已释放
+/* 从其他参与者的区间后端窃取一半：自己处理窃得的第一块，其余放入自己的区间 */
+static int range_steal(ParallelJob* job, int self, size_t* k) {
+    for (int d = 1; d < job->nranges; d++) {
+        uint64_t* victim = &job->ranges[(self + d) % job->nranges];
+        uint64_t r = __atomic_load_n(victim, __ATOMIC_ACQUIRE);
+        while (RANGE_LO(r) < RANGE_HI(r)) {
+            uint32_t lo = RANGE_LO(r), hi = RANGE_HI(r);
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (__atomic_compare_exchange_n(victim, &r, RANGE_PACK(lo, mid),
+                                            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&job->ranges[self], RANGE_PACK(mid + 1, hi), __ATOMIC_RELEASE);
+                *k = mid;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* libffi 把窄于 ffi_arg 的整数返回值扩展成整个 ffi_arg；按类型截断后写入 dst，
+ * 大端平台上有效字节不在缓冲区起始处，不能直接 memcpy */
+static void ffi_ret_store(void* dst, const void* ret, ffi_type* type) {
+    if (type->size < sizeof(ffi_arg)) {
+        ffi_arg v = *(const ffi_arg*)ret;
+        switch (type->type) {
+            case FFI_TYPE_SINT8:  case FFI_TYPE_UINT8:  { uint8_t  x = (uint8_t)v;  memcpy(dst, &x, 1); return; }
+            case FFI_TYPE_SINT16: case FFI_TYPE_UINT16: { uint16_t x = (uint16_t)v; memcpy(dst, &x, 2); return; }
+            case FFI_TYPE_SINT32: case FFI_TYPE_UINT32:
+            case FFI_TYPE_INT:                          { uint32_t x = (uint32_t)v; memcpy(dst, &x, 4); return; }
+            default: break;
+        }
+    }
+    memcpy(dst, ret, type->size);
+}
+
+static void parallel_chunk(ParallelJob* job, size_t k, char* tmp, char* acc) {
+    size_t lo = k * job->chunk;
+    size_t hi = lo + job->chunk < job->n ? lo + job->chunk : job->n;
+    if (!job->reduce) {
+        for (size_t i = lo; i < hi; i++) {
+            void* a = (void*)(job->in + i * job->in_stride);
+            ffi_call(job->cif, FFI_FN(job->fn), tmp, &a);
+            ffi_ret_store(job->out + i * job->out_stride, tmp, job->ret_type);
+        }
+    } else {
+        memcpy(acc, job->in + lo * job->in_stride, job->in_stride);
+        for (size_t i = lo + 1; i < hi; i++) {
+            void* a[2] = { acc, (void*)(job->in + i * job->in_stride) };
+            ffi_call(job->cif, FFI_FN(job->fn), tmp, a);
+            ffi_ret_store(acc, tmp, job->ret_type);
+        }
+        memcpy(job->out + k * job->out_stride, acc, job->out_stride);
+    }
+}
 
-    map_remove(code);
+/* 工作者先处理自己区间内的块，做完后从其他参与者处窃取，扫描一圈都为空时退出 */
+static void parallel_worker(void* arg) {
+    ParallelJob* job = (ParallelJob*)arg;
+    char* tmp = alloca(job->ret_size);
+    char* acc = alloca(job->ret_size);
+    int self = __atomic_fetch_add(&job->next_worker, 1, __ATOMIC_RELAXED);
+    size_t k;
+    while (range_pop(&job->ranges[self], &k) || range_steal(job, self, &k))
+        parallel_chunk(job, k, tmp, acc);
+
+    pthread_mutex_lock(&job->lock);
+    if (--job->pending == 0) pthread_cond_signal(&job->done);
+    pthread_mutex_unlock(&job->lock);
+}
 
-    // 释放 Lua 函数引用
-    luaL_unref(info->L, LUA_REGISTRYINDEX, info->func_ref);
+/* 按线程数切分块：每个线程约 8 块，每块至少 1024 个元素；块号需放得进 32 位区间 */
+static void parallel_split(ParallelJob* job, int threads) {
+    size_t per = job->n / ((size_t)threads * 8);
+    job->chunk = per < 1024 ? 1024 : per;
+    if (job->n / job->chunk >= UINT32_MAX) job->chunk = job->n / (UINT32_MAX - 1) + 1;
+    job->nchunks = (job->n + job->chunk - 1) / job->chunk;
+}
 
-    // 释放 closure
-    ffi_closure_free(info->writable);
+/* 块平均分到各参与者的区间；调用线程也参与计算，返回前等待已开始的工作者结束。
+ * 未能提交或被撤回的参与者，其区间由其他工作者窃取完成 */
+static void parallel_run(ParallelJob* job, int threads) {
+    if ((size_t)threads > job->nchunks) threads = (int)job->nchunks;
+    job->ranges = alloca(sizeof(uint64_t) * threads);
+    job->nranges = threads;
+    for (int t = 0; t < threads; t++) {
+        size_t lo = job->nchunks * t / threads, hi = job->nchunks * (t + 1) / threads;
+        job->ranges[t] = RANGE_PACK(lo, hi);
+    }
+    job->next_worker = 0;
+    job->pending = 1;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
+
+    for (int t = 1; t < threads; t++) {
+        pthread_mutex_lock(&job->lock);
+        job->pending++;
+        pthread_mutex_unlock(&job->lock);
+        if (!pool_submit(&__g_pool, parallel_worker, job)) {
+            pthread_mutex_lock(&job->lock);
+            job->pending--;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+    parallel_worker(job);
+
+    /* 调用线程退出时所有区间已空，撤回仍在排队的工作者，不必等它们轮到执行 */
+    int cancelled = pool_cancel(&__g_pool, parallel_worker, job);
+    pthread_mutex_lock(&job->lock);
+    job->pending -= cancelled;
+    while (job->pending > 0)
+        pthread_cond_wait(&job->done, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+    pthread_cond_destroy(&job->done);
+    pthread_mutex_destroy(&job->lock);
+}
 
-    // 释放签名数组
-    free(info->sign_base);
+static int check_parallel_threads(lua_State* L, int idx) {
+    int max = pool_size(&__g_pool) + 1;
+    lua_Integer threads = luaL_optinteger(L, idx, max - 1 > 0 ? max - 1 : 1);
+    if (threads < 1) threads = 1;
+    if (threads > max) threads = max;
+    return (int)threads;
+}
 
-    // 释放 info 本身
-    free(info);
+/* 取并行调用的缓冲区，并检查其能容纳 n 个 stride 字节的元素 */
+static char* check_parallel_buffer(lua_State* L, int idx, lua_Integer n, size_t stride, const char* fname) {
+    size_t capacity;
+    char* buf = to_c_buffer(L, idx, &capacity);
+    if (!buf || capacity == 0) luaL_error(L, "LuaFFI: %s needs a data buffer at argument %d", fname, idx);
+    if (stride && (lua_Unsigned)n > capacity / stride)
+        luaL_error(L, "LuaFFI: %s buffer at argument %d is too small for %d elements", fname, idx, (int)n);
+    return buf;
+}
 
+/* ---------- LuaFFI.parallelMap(nf, inBuf, outBuf, n[, threads])：out[i] = f(in[i]) ---------- */
+int parallelMap(lua_State* L) {
+    NativeFunction* nf = *(NativeFunction**)luaL_checkudata(L, 1, "NativeFunction");
+    if (!nf) luaL_error(L, "LuaFFI: NativeFunction is NULL");
+    Signature* sig = nf->sig;
+    if (sig->is_variadic || sig->nfixed != 1 || sig->ret_type->type == FFI_TYPE_VOID || sig->out_plan.nlua)
+        luaL_error(L, "LuaFFI: parallelMap needs a non-void function with exactly one argument");
+
+    lua_Integer n = luaL_checkinteger(L, 4);
+    int threads = check_parallel_threads(L, 5);
+    if (n <= 0) return 0;
+    const char* in = check_parallel_buffer(L, 2, n, sig->arg_types[0]->size, "parallelMap");
+    char* out = check_parallel_buffer(L, 3, n, sig->ret_type->size, "parallelMap");
+
+    ParallelJob job;
+    memset(&job, 0, sizeof(job));
+    job.cif        = &sig->cif;
+    job.fn         = nf->func_ptr;
+    job.ret_type   = sig->ret_type;
+    job.in         = in;
+    job.out        = out;
+    job.in_stride  = sig->arg_types[0]->size;
+    job.out_stride = sig->ret_type->size;
+    job.ret_size   = sig->ret_size;
+    job.n          = (size_t)n;
+    parallel_split(&job, threads);
+    parallel_run(&job, threads);
     return 0;
 }
 
-int getString(lua_State* L) {
-    LUA_ARGC_ASSERT(L, 1);
-    LUA_TYPE_ASSERT(L, lightuserdata, 1);
-    void* ptr = lua_touserdata(L, 1);
-    if (!ptr) {
-        lua_pushnil(L);
-        return 1;
+/* ---------- LuaFFI.parallelReduce(nf, inBuf, n, init[, threads])：acc = f(acc, in[i]) ---------- */
+int parallelReduce(lua_State* L) {
+    NativeFunction* nf = *(NativeFunction**)luaL_checkudata(L, 1, "NativeFunction");
+    if (!nf) luaL_error(L, "LuaFFI: NativeFunction is NULL");
+    Signature* sig = nf->sig;
+    if (sig->is_variadic || sig->nfixed != 2 || sig->out_plan.nlua ||
+        sig->arg_types[0] != sig->ret_type || sig->arg_types[1] != sig->ret_type)
+        luaL_error(L, "LuaFFI: parallelReduce needs a function of type T(T, T)");
+
+    lua_Integer n = luaL_checkinteger(L, 3);
+    luaL_checkany(L, 4);
+    int threads = check_parallel_threads(L, 5);
+    size_t stride = sig->ret_type->size;
+
+    /* 初始值写入累加器 */
+    void* acc = alloca(sig->ret_size);
+    memset(acc, 0, sig->ret_size);
+    plan_to_c(L, &sig->ret_plan, 4, &acc);
+
+    if (n > 0) {
+        const char* in = check_parallel_buffer(L, 2, n, stride, "parallelReduce");
+        ParallelJob job;
+        memset(&job, 0, sizeof(job));
+        job.cif        = &sig->cif;
+        job.fn         = nf->func_ptr;
+        job.ret_type   = sig->ret_type;
+        job.in         = in;
+        job.in_stride  = stride;
+        job.out_stride = stride;
+        job.ret_size   = sig->ret_size;
+        job.n          = (size_t)n;
+        job.reduce     = 1;
+
+        parallel_split(&job, threads);
+        job.out = malloc(job.nchunks * stride);   // 每块一个部分结果
+        LUA_ALLOC_ASSERT(L, job.out);
+        parallel_run(&job, threads);
+
+        /* 按块顺序合并部分结果，保证结合律函数结果确定 */
+        void* tmp = alloca(sig->ret_size);
+        for (size_t k = 0; k < job.nchunks; k++) {
+            void* a[2] = { acc, job.out + k * stride };
+            ffi_call(&sig->cif, FFI_FN(nf->func_ptr), tmp, a);
+            ffi_ret_store(acc, tmp, sig->ret_type);
+        }
+        free(job.out);
     }
-    const char* str = (const char*)ptr;
-    lua_pushstring(L, str);
+
+    plan_to_lua(L, &sig->ret_plan, &acc);
     return 1;
 }
 
-static lua_State* get_thread_lua_state(void) {
-    pthread_once(&key_once, create_key);
-    lua_State* L = pthread_getspecific(lua_state_key);
+/* 标准库表，顺序即 THREAD_LIB_* 的位序 */
+static const luaL_Reg __thread_libs[] = {
+    {LUA_GNAME, luaopen_base},
+    {LUA_LOADLIBNAME, luaopen_package},
+    {LUA_COLIBNAME, luaopen_coroutine},
+    {LUA_TABLIBNAME, luaopen_table},
+    {LUA_IOLIBNAME, luaopen_io},
+    {LUA_OSLIBNAME, luaopen_os},
+    {LUA_STRLIBNAME, luaopen_string},
+    {LUA_MATHLIBNAME, luaopen_math},
+    {LUA_UTF8LIBNAME, luaopen_utf8},
+    {LUA_DBLIBNAME, luaopen_debug},
+    {NULL, NULL}
+};
+
+/* 按当前配置创建并初始化一个线程状态（调用者持有配置的快照，不加锁） */
+static ThreadCtx* thread_ctx_new(unsigned libs, const char* init, size_t init_len, unsigned gen) {
+    ThreadCtx* ctx = calloc(1, sizeof(ThreadCtx));
+    if (!ctx) return NULL;
+    lua_State* L = luaL_newstate();
     if (!L) {
-        L = luaL_newstate();
+        free(ctx);
+        return NULL;
+    }
+    if (libs == THREAD_LIB_ALL) {
         luaL_openlibs(L);
-        luaopen_XShare(L);   // 注册 XShare 模块
-        lua_pop(L, 1);        // 弹出模块表
-        pthread_setspecific(lua_state_key, L);
+    } else {
+        for (int i = 0; __thread_libs[i].name; i++) {
+            if (!(libs & (1u << i))) continue;
+            luaL_requiref(L, __thread_libs[i].name, __thread_libs[i].func, 1);
+            lua_pop(L, 1);
+        }
     }
-    return L;
-}
+    luaopen_XShare(L);   // 注册 XShare 模块
+    lua_pop(L, 1);        // 弹出模块表
 
-static void map_insert_mt(void* code, LuaClosureInfoMT* info) {
-    unsigned int h = (unsigned long)code % 256;
-    pthread_mutex_lock(&map_mutex_mt);
-    MapEntryMT* e = malloc(sizeof(MapEntryMT));
-    e->code = code;
-    e->info = info;
-    e->next = map_mt[h];
-    map_mt[h] = e;
-    pthread_mutex_unlock(&map_mutex_mt);
+    if (init && (luaL_loadbufferx(L, init, init_len, "=init", "b") != LUA_OK ||
+                 lua_pcall(L, 0, 0, 0) != LUA_OK)) {
+        fprintf(stderr, "LuaFFI: thread state init failed: %s\n", lua_tostring(L, -1));
+    }
+    lua_settop(L, 0);
+    lua_newtable(L);      // 栈索引 1：已还原函数的缓存表
+    ctx->L = L;
+    ctx->config_gen = gen;
+    return ctx;
 }
 
-static LuaClosureInfoMT* map_find_mt(void* code) {
-    unsigned int h = (unsigned long)code % 256;
-    pthread_mutex_lock(&map_mutex_mt);
-    MapEntryMT* e = map_mt[h];
-    while (e) {
-        if (e->code == code) {
-            pthread_mutex_unlock(&map_mutex_mt);
-            return e->info;
+static ThreadCtx* get_thread_ctx(void) {
+    pthread_once(&key_once, create_key);
+    ThreadCtx* ctx = pthread_getspecific(lua_state_key);
+    if (ctx) return ctx;
+
+    /* 优先从预热池取出，否则按当前配置现场创建：持锁只拷贝配置，创建在锁外进行，
+     * 冷启动的线程之间不互相等待；创建期间配置被修改时丢弃按旧配置创建的状态并重试 */
+    ThreadStateConfig* cfg = &__g_state_config;
+    for (;;) {
+        pthread_mutex_lock(&cfg->lock);
+        ctx = cfg->pool;
+        if (ctx) {
+            cfg->pool = ctx->next;
+            cfg->npool--;
+            pthread_mutex_unlock(&cfg->lock);
+            break;
         }
-        e = e->next;
+        unsigned libs = cfg->libs;
+        unsigned gen = cfg->gen;
+        size_t init_len = cfg->init_len;
+        char* init = cfg->init ? malloc(init_len) : NULL;
+        if (init) memcpy(init, cfg->init, init_len);
+        int copy_failed = cfg->init && !init;
+        pthread_mutex_unlock(&cfg->lock);
+        if (copy_failed) return NULL;
+
+        ctx = thread_ctx_new(libs, init, init_len, gen);
+        free(init);
+        if (!ctx) return NULL;
+
+        pthread_mutex_lock(&cfg->lock);
+        int stale = cfg->gen != gen;
+        pthread_mutex_unlock(&cfg->lock);
+        if (!stale) break;
+        thread_ctx_close(ctx);
     }
-    pthread_mutex_unlock(&map_mutex_mt);
-    return NULL;
+    ctx->next = NULL;
+    pthread_setspecific(lua_state_key, ctx);
+    return ctx;
 }
 
-static void map_remove_mt(void* code) {
-    unsigned int h = (unsigned long)code % 256;
-    pthread_mutex_lock(&map_mutex_mt);
-    MapEntryMT** p = &map_mt[h];
-    while (*p) {
-        if ((*p)->code == code) {
-            MapEntryMT* tmp = *p;
-            *p = (*p)->next;
-            free(tmp);
-            break;
-        }
-        p = &(*p)->next;
+/* 将闭包函数压栈：命中线程缓存时只需一次 rawgeti，否则还原并写入缓存 */
+static void thread_ctx_push_function(ThreadCtx* ctx, LuaClosureInfoMT* info) {
+    lua_State* L = ctx->L;
+    int id = info->cache_slot;
+    if (id < ctx->ngens && ctx->gens[id] == info->cache_gen) {
+        lua_rawgeti(L, 1, id + 1);
+        return;
+    }
+
+    stored_push(L, info->func_obj);
+    if (id >= ctx->ngens) {
+        int n = ctx->ngens ? ctx->ngens : 64;
+        while (n <= id) n *= 2;
+        unsigned* gens = realloc(ctx->gens, n * sizeof(unsigned));
+        if (!gens) return;                  // 无法缓存，仅本次使用
+        memset(gens + ctx->ngens, 0, (n - ctx->ngens) * sizeof(unsigned));
+        ctx->gens = gens;
+        ctx->ngens = n;
     }
-    pthread_mutex_unlock(&map_mutex_mt);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 1, id + 1);
+    ctx->gens[id] = info->cache_gen;
 }
 
 /* ---------- 多线程闭包回调函数 ---------- */
 static void lua_closure_callback_mt(ffi_cif* cif, void* ret, void** args, void* user_data) {
     LuaClosureInfoMT* info = (LuaClosureInfoMT*)user_data;
-    lua_State* L = get_thread_lua_state();
-    if (!L) {
+    ThreadCtx* ctx = get_thread_ctx();
+    if (!ctx) {
         fprintf(stderr, "Fatal: cannot get Lua state for current thread\n");
         abort();
     }
+    lua_State* L = ctx->L;
     int top = lua_gettop(L);
+    Signature* sig = info->sig;
+    CallStats* st = NULL;
+    uint64_t t0 = 0, t1 = 0, t2 = 0;
+    if (stats_enabled()) t0 = stats_now();
 
-    // 还原 Lua 函数
-    stored_push(L, info->func_obj);
+    // 取出 Lua 函数（首次调用时还原并缓存）
+    thread_ctx_push_function(ctx, info);
+    if (t0) st = closure_stats(L, &info->stats, STATS_LUA_MT, sig);
+    int traced = closure_trace_enter(L, info, &info->trace_epoch, TRACE_LUA_MT, sig);
 
-    // 压入参数（假设已存在 lua_push_cvalue 函数）
-    for (int i = 0; i < info->nargs; i++) {
-        lua_push_cvalue(L, args[i], info->arg_types[i]);
-    }
+    // 按预编译计划压入参数
+    plan_to_lua(L, &sig->args_plan, args);
 
     // 调用
-    if (lua_pcall(L, info->nargs, 1, 0) != LUA_OK) {
+    if (st) t1 = stats_now();
+    if (lua_pcall(L, sig->args_plan.nlua, 1, 0) != LUA_OK) {
         const char* err = lua_tostring(L, -1);
         fprintf(stderr, "Lua closure error: %s\n", err);
         // 错误时，可考虑设置默认返回值或继续抛出（但跨线程 longjmp 危险）
         lua_settop(L, top);
+        if (traced) trace_emit(info, 'E');
         return;
     }
 
+    if (st) t2 = stats_now();
+
     // 处理返回值
-    if (info->ret_type->type != FFI_TYPE_VOID) {
-        lua_to_cvalue(L, -1, info->ret_type, ret);
+    if (sig->ret_type->type != FFI_TYPE_VOID) {
+        plan_to_c(L, &sig->ret_plan, lua_gettop(L), &ret);
         lua_pop(L, 1);
     }
     lua_settop(L, top);
+    if (st) stats_record(st, t0, t1, t2, stats_now());
+    if (traced) trace_emit(info, 'E');
+}
+
+static void lua_closure_release_mt(LuaClosureInfoMT* info) {
+    info->cache_gen = 0;                                        // 使各线程的缓存失效
+    gc_release((GCObject*)info->func_obj);                      // 释放序列化函数
+    signature_release(info->sig);                               // 释放签名句柄
+    stats_free(info->stats);                                    // 注销调用统计
+    info->stats = NULL;
+    closure_slot_release(container_of(info, ClosureSlot, info.mt));
+}
+
+/* lua_dump 写入器：追加到 malloc 的缓冲区 */
+typedef struct DumpBuffer {
+    char* data;
+    size_t len;
+} DumpBuffer;
+
+static int dump_writer(lua_State* L, const void* p, size_t sz, void* ud) {
+    DumpBuffer* b = (DumpBuffer*)ud;
+    char* data = realloc(b->data, b->len + sz);
+    if (!data) return 1;
+    memcpy(data + b->len, p, sz);
+    b->data = data;
+    b->len += sz;
+    return 0;
+}
+
+/* ---------- LuaFFI.configureThreadStates{pool=, libs=, init=} -> 池中状态数 ----------
+ * libs：标准库名数组（如 {"base", "string"}）或 "all"；init：函数或代码字符串，
+ * 预编译为字节码后在每个新状态中执行一次；pool：预先创建并保留的状态数。 */
+int configureThreadStates(lua_State* L) {
+    LUA_ARGC_ASSERT(L, 1);
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    unsigned libs = THREAD_LIB_ALL;
+    lua_getfield(L, 1, "libs");
+    if (lua_istable(L, -1)) {
+        libs = 0;
+        for (int i = 1; lua_rawgeti(L, -1, i) != LUA_TNIL; i++) {
+            const char* name = luaL_checkstring(L, -1);
+            int k = 0;
+            for (; __thread_libs[k].name; k++) {
+                if (strcmp(name, __thread_libs[k].name) == 0 ||
+                    (k == 0 && strcmp(name, "base") == 0)) break;
+            }
+            if (!__thread_libs[k].name) luaL_error(L, "LuaFFI: unknown library %s", name);
+            libs |= 1u << k;
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    } else if (!lua_isnil(L, -1) && strcmp(luaL_checkstring(L, -1), "all") != 0) {
+        luaL_error(L, "LuaFFI: libs must be a list of library names or \"all\"");
+    }
+    lua_pop(L, 1);
+
+    /* 预编译初始化代码块 */
+    char* init = NULL;
+    size_t init_len = 0;
+    lua_getfield(L, 1, "init");
+    if (!lua_isnil(L, -1)) {
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            size_t len;
+            const char* code = lua_tolstring(L, -1, &len);
+            if (luaL_loadbufferx(L, code, len, "=init", "t") != LUA_OK) lua_error(L);
+            lua_remove(L, -2);
+        }
+        luaL_checktype(L, -1, LUA_TFUNCTION);
+        DumpBuffer b = { NULL, 0 };
+        if (lua_dump(L, dump_writer, &b, 0) != 0 || !b.data) {
+            free(b.data);
+            luaL_error(L, "LuaFFI: failed to dump init chunk");
+        }
+        init = b.data;
+        init_len = b.len;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "pool");
+    int pool_max = (int)luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+    if (pool_max < 0) pool_max = 0;
+
+    /* 替换配置，丢弃按旧配置创建的空闲状态 */
+    ThreadStateConfig* cfg = &__g_state_config;
+    pthread_mutex_lock(&cfg->lock);
+    char* old_init = cfg->init;
+    ThreadCtx* stale = cfg->pool;
+    cfg->libs = libs;
+    cfg->init = init;
+    cfg->init_len = init_len;
+    cfg->pool_max = pool_max;
+    cfg->gen++;
+    cfg->pool = NULL;
+    cfg->npool = 0;
+    unsigned gen = cfg->gen;
+    pthread_mutex_unlock(&cfg->lock);
+    free(old_init);
+    while (stale) {
+        ThreadCtx* next = stale->next;
+        thread_ctx_close(stale);
+        stale = next;
+    }
+
+    /* 预热：在调用线程中创建状态放入池中 */
+    int ready = 0;
+    for (int i = 0; i < pool_max; i++) {
+        ThreadCtx* ctx = thread_ctx_new(libs, init, init_len, gen);
+        if (!ctx) break;
+        pthread_mutex_lock(&cfg->lock);
+        int keep = cfg->gen == gen && cfg->npool < cfg->pool_max;
+        if (keep) {
+            ctx->next = cfg->pool;
+            cfg->pool = ctx;
+            ready = ++cfg->npool;
+        }
+        pthread_mutex_unlock(&cfg->lock);
+        if (!keep) {
+            thread_ctx_close(ctx);
+            break;
+        }
+    }
+    lua_pushinteger(L, ready);
+    return 1;
 }
 
 /* ---------- wrapLuaFunctionMT：创建多线程安全闭包 ---------- */
 int wrapLuaFunctionMT(lua_State* L) {
-    // 参数检查：两个字符串
-    if (lua_gettop(L) != 2)
-        return luaL_error(L, "wrapLuaFunctionMT: expected exactly 2 arguments");
-    if (!lua_isstring(L, 1) || !lua_isstring(L, 2))
-        return luaL_error(L, "wrapLuaFunctionMT: both arguments must be strings");
+    // 参数检查：函数名字符串 + 签名（字符串或 Signature）+ 可选的选项表
+    if (lua_gettop(L) != 2 && lua_gettop(L) != 3)
+        return luaL_error(L, "wrapLuaFunctionMT: expected 2 or 3 arguments");
+    if (!lua_isstring(L, 1))
+        return luaL_error(L, "wrapLuaFunctionMT: function name must be a string");
+    int managed = closure_opts_managed(L, 3);
 
     const char* func_name = lua_tostring(L, 1);
-    const char* sign = lua_tostring(L, 2);
 
     // 1. 获取 Lua 函数
     lua_getglobal(L, func_name);
@@ -788,82 +3338,63 @@ int wrapLuaFunctionMT(lua_State* L) {
         return luaL_error(L, "wrapLuaFunctionMT: %s is not a function", func_name);
     }
 
-    // 2. 解析签名（假设已有 parse_string_fsm 函数）
-    ffi_type** sign_types = parse_string_fsm(sign);
-    if (!sign_types || !sign_types[0]) {
-        free(sign_types);
-        return luaL_error(L, "wrapLuaFunctionMT: invalid signature (missing return type)");
+    // 2. 获取驻留的签名句柄（不支持可变参数）
+    Signature* sig = check_signature(L, 2);
+    if (sig->is_variadic) {
+        signature_release(sig);
+        return luaL_error(L, "wrapLuaFunctionMT: variadic arguments not supported");
     }
-    // 检查可变参数标记（不支持）
-    for (int i = 1; sign_types[i] != NULL; i++) {
-        if (sign_types[i] == (ffi_type*)VARIABLE) {
-            free(sign_types);
-            return luaL_error(L, "wrapLuaFunctionMT: variadic arguments not supported");
-        }
+    if (sig->ret_type == &__ffi_type_string) {
+        signature_release(sig);
+        return luaL_error(L, "wrapLuaFunctionMT: z return type not supported");
+    }
+    if (sig->out_plan.nlua) {
+        signature_release(sig);
+        return luaL_error(L, "wrapLuaFunctionMT: out-parameters (& / *) not supported");
     }
-
-    // 计算参数个数
-    int nargs = 0;
-    while (sign_types[nargs + 1] != NULL) nargs++;
 
     // 3. 序列化函数
     StoredObject* func_obj = stored_create(L, -1);  // 栈顶是函数
     if (!func_obj) {
-        free(sign_types);
+        signature_release(sig);
         return luaL_error(L, "wrapLuaFunctionMT: failed to serialize function");
     }
 
-    // 4. 分配信息结构
-    LuaClosureInfoMT* info = malloc(sizeof(LuaClosureInfoMT));
-    if (!info) {
-        free(sign_types);
+    // 4. 从池中取出槽位（含 closure 与 LuaClosureInfoMT）
+    ClosureSlot* slot = closure_slot_acquire();
+    if (!slot) {
+        signature_release(sig);
         gc_release((GCObject*)func_obj);
-        return luaL_error(L, "wrapLuaFunctionMT: out of memory");
-    }
-    info->func_obj = func_obj;
-    info->sign_base = sign_types;
-    info->ret_type = sign_types[0];
-    info->arg_types = sign_types + 1;
-    info->nargs = nargs;
-
-    // 5. 分配 closure
-    void* code;
-    ffi_closure* closure = ffi_closure_alloc(sizeof(ffi_closure), &code);
-    if (!closure) {
-        free(sign_types);
-        gc_release((GCObject*)func_obj);
-        free(info);
         return luaL_error(L, "wrapLuaFunctionMT: ffi_closure_alloc failed");
     }
-    info->writable = closure;
-
-    // 6. 准备 ffi_cif
-    ffi_status status = ffi_prep_cif(&info->cif, FFI_DEFAULT_ABI, nargs,
-                                      info->ret_type, info->arg_types);
-    if (status != FFI_OK) {
-        ffi_closure_free(closure);
-        free(sign_types);
-        gc_release((GCObject*)func_obj);
-        free(info);
-        return luaL_error(L, "wrapLuaFunctionMT: ffi_prep_cif failed");
-    }
-
-    // 7. 准备 closure
-    status = ffi_prep_closure_loc(closure, &info->cif, lua_closure_callback_mt,
-                                   info, code);
+    LuaClosureInfoMT* info = &slot->info.mt;
+    info->func_obj = func_obj;
+    info->sig = sig;
+    info->writable = slot->writable;
+    info->stats = NULL;
+    info->trace_epoch = 0;
+    info->cache_slot = slot->id;
+    info->cache_gen = __atomic_add_fetch(&__g_closure_gen, 1, __ATOMIC_RELAXED);
+    if (info->cache_gen == 0)       // 回绕时跳过 0
+        info->cache_gen = __atomic_add_fetch(&__g_closure_gen, 1, __ATOMIC_RELAXED);
+
+    // 5. 准备 closure（cif 由签名句柄预先生成）
+    void* code = slot->code;
+    ffi_status status = ffi_prep_closure_loc(slot->writable, &sig->cif, lua_closure_callback_mt,
+                                             info, code);
     if (status != FFI_OK) {
-        ffi_closure_free(closure);
-        free(sign_types);
-        gc_release((GCObject*)func_obj);
-        free(info);
+        lua_closure_release_mt(info);
         return luaL_error(L, "wrapLuaFunctionMT: ffi_prep_closure_loc failed");
     }
 
-    // 8. 插入映射
-    map_insert_mt(code, info);
+    // 6. 插入映射
+    if (!registry_insert(&__g_closures_mt, code, info)) {
+        lua_closure_release_mt(info);
+        return luaL_error(L, "wrapLuaFunctionMT: out of memory");
+    }
 
-    // 9. 返回可执行地址
-    lua_pushlightuserdata(L, code);
+    // 7. 返回可执行地址
+    push_closure_code(L, code, managed, 1);
     return 1;
 }
 
@@ -871,30 +3402,260 @@ int wrapLuaFunctionMT(lua_State* L) {
 int unwrapLuaFunctionMT(lua_State* L) {
     if (lua_gettop(L) != 1)
         return luaL_error(L, "unwrapLuaFunctionMT: expected exactly 1 argument");
-    if (!lua_islightuserdata(L, 1))
-        return luaL_error(L, "unwrapLuaFunctionMT: argument must be lightuserdata");
 
-    void* code = lua_touserdata(L, 1);
-    LuaClosureInfoMT* info = map_find_mt(code);
+    void* code = take_closure_code(L, 1, 1);
+    LuaClosureInfoMT* info = registry_take(&__g_closures_mt, code);
     if (!info) return 0;   // 未找到，可能已释放
 
-    map_remove_mt(code);
+    lua_closure_release_mt(info);
+    return 0;
+}
+
+/* ---------- LuaClosure 句柄的元方法 ---------- */
+static int luaclosure_gc(lua_State* L) {
+    LuaClosureHandle* h = (LuaClosureHandle*)luaL_checkudata(L, 1, "LuaClosure");
+    if (!h->code) return 0;
+    if (h->mt) {
+        LuaClosureInfoMT* info = registry_take(&__g_closures_mt, h->code);
+        if (info) lua_closure_release_mt(info);
+    } else {
+        LuaClosureInfo* info = registry_take(&__g_closures, h->code);
+        if (info) lua_closure_release(info);
+    }
+    h->code = NULL;
+    return 0;
+}
+
+static int luaclosure_tostring(lua_State* L) {
+    LuaClosureHandle* h = (LuaClosureHandle*)luaL_checkudata(L, 1, "LuaClosure");
+    lua_pushfstring(L, "LuaClosure%s: %p", h->mt ? "MT" : "", h->code);
+    return 1;
+}
+
+/* ---------- 调用统计：LuaFFI.enableStats / stats / resetStats ---------- */
+/* LuaFFI.enableStats([flag]) -> 之前的状态 */
+int enableStats(lua_State* L) {
+    int on = lua_isnone(L, 1) ? 1 : lua_toboolean(L, 1);
+    lua_pushboolean(L, __atomic_exchange_n(&__g_stats_enabled, on, __ATOMIC_RELAXED));
+    return 1;
+}
+
+static int stats_compare(const void* a, const void* b) {
+    uint64_t x = (*(CallStats* const*)a)->total_ns, y = (*(CallStats* const*)b)->total_ns;
+    return (x < y) - (x > y);
+}
+
+/* 直方图中第 q 分位所在桶的上界 */
+static uint64_t stats_percentile(const CallStats* st, uint64_t count, double q) {
+    uint64_t want = (uint64_t)(q * (double)count + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += st->hist[b];
+        if (seen >= want) return stats_bucket_high(b) - 1;
+    }
+    return st->max_ns;
+}
 
-    // 释放序列化函数
-    gc_release((GCObject*)info->func_obj);
+static void set_field_u64(lua_State* L, const char* key, uint64_t v) {
+    lua_pushinteger(L, (lua_Integer)v);
+    lua_setfield(L, -2, key);
+}
 
-    // 释放 closure
-    ffi_closure_free(info->writable);
+/* LuaFFI.stats([histogram]) -> {{name=, kind=, count=, ...}, ...}，按累计耗时降序 */
+int callStats(lua_State* L) {
+    static const char* kinds[] = { "native", "lua", "luaMT" };
+    int with_hist = lua_toboolean(L, 1);
+
+    /* 在锁内拷贝快照，构造 Lua 表时不持锁 */
+    pthread_mutex_lock(&__g_stats_lock);
+    size_t n = 0;
+    for (CallStats* st = __g_stats_head; st; st = st->next) n++;
+    CallStats* snap = n ? malloc(n * sizeof(CallStats)) : NULL;
+    CallStats** order = n ? malloc(n * sizeof(CallStats*)) : NULL;
+    if (n && (!snap || !order)) {
+        pthread_mutex_unlock(&__g_stats_lock);
+        free(snap);
+        free(order);
+        luaL_error(L, "LuaFFI: out of memory");
+    }
+    size_t i = 0;
+    for (CallStats* st = __g_stats_head; st; st = st->next, i++) {
+        CallStats* c = &snap[i];
+        c->kind = st->kind;
+        c->name = strdup(st->name);     // 绑定可能在解锁后释放，名字一并拷贝
+        c->count = __atomic_load_n(&st->count, __ATOMIC_RELAXED);
+        c->total_ns = __atomic_load_n(&st->total_ns, __ATOMIC_RELAXED);
+        c->max_ns = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+        c->marshal_ns = __atomic_load_n(&st->marshal_ns, __ATOMIC_RELAXED);
+        c->target_ns = __atomic_load_n(&st->target_ns, __ATOMIC_RELAXED);
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            c->hist[b] = __atomic_load_n(&st->hist[b], __ATOMIC_RELAXED);
+        order[i] = c;
+    }
+    pthread_mutex_unlock(&__g_stats_lock);
+
+    if (n) qsort(order, n, sizeof(CallStats*), stats_compare);
+    lua_createtable(L, (int)n, 0);
+    for (i = 0; i < n; i++) {
+        CallStats* c = order[i];
+        uint64_t count = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++) count += c->hist[b];
+        lua_createtable(L, 0, 12);
+        lua_pushstring(L, c->name ? c->name : "?");
+        lua_setfield(L, -2, "name");
+        lua_pushstring(L, kinds[c->kind]);
+        lua_setfield(L, -2, "kind");
+        set_field_u64(L, "count", c->count);
+        set_field_u64(L, "total_ns", c->total_ns);
+        set_field_u64(L, "max_ns", c->max_ns);
+        set_field_u64(L, "marshal_ns", c->marshal_ns);
+        set_field_u64(L, "target_ns", c->target_ns);
+        lua_pushnumber(L, c->count ? (lua_Number)c->total_ns / (lua_Number)c->count : 0);
+        lua_setfield(L, -2, "mean_ns");
+        if (count) {
+            set_field_u64(L, "p50_ns", stats_percentile(c, count, 0.50));
+            set_field_u64(L, "p90_ns", stats_percentile(c, count, 0.90));
+            set_field_u64(L, "p99_ns", stats_percentile(c, count, 0.99));
+            set_field_u64(L, "p999_ns", stats_percentile(c, count, 0.999));
+        }
+        if (with_hist) {
+            /* 只输出非空桶：{{low_ns, high_ns, count}, ...} */
+            lua_newtable(L);
+            int k = 0;
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                if (!c->hist[b]) continue;
+                lua_createtable(L, 3, 0);
+                lua_pushinteger(L, (lua_Integer)stats_bucket_low(b));
+                lua_rawseti(L, -2, 1);
+                lua_pushinteger(L, (lua_Integer)stats_bucket_high(b));
+                lua_rawseti(L, -2, 2);
+                lua_pushinteger(L, (lua_Integer)c->hist[b]);
+                lua_rawseti(L, -2, 3);
+                lua_rawseti(L, -2, ++k);
+            }
+            lua_setfield(L, -2, "histogram");
+        }
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    for (i = 0; i < n; i++) free(snap[i].name);
+    free(order);
+    free(snap);
+    return 1;
+}
 
-    // 释放签名数组
-    free(info->sign_base);
+/* LuaFFI.resetStats()：清零所有统计项（绑定保留各自的统计项） */
+int resetStats(lua_State* L) {
+    pthread_mutex_lock(&__g_stats_lock);
+    for (CallStats* st = __g_stats_head; st; st = st->next)
+        stats_reset(st);
+    pthread_mutex_unlock(&__g_stats_lock);
+    return 0;
+}
 
-    // 释放信息结构
-    free(info);
+/* ---------- 调用追踪：LuaFFI.traceStart / traceStop / traceDump ---------- */
+/* LuaFFI.traceStart()：清空之前的事件并开始记录 */
+int traceStart(lua_State* L) {
+    trace_reset();
+    __atomic_store_n(&__g_trace_enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
+/* LuaFFI.traceStop()：停止记录，已记录的事件保留到下次 traceStart */
+int traceStop(lua_State* L) {
+    __atomic_store_n(&__g_trace_enabled, 0, __ATOMIC_RELEASE);
     return 0;
 }
 
+static int trace_name_compare(const void* a, const void* b) {
+    const TraceName* x = *(TraceName* const*)a;
+    const TraceName* y = *(TraceName* const*)b;
+    if (x->id != y->id) return (uintptr_t)x->id < (uintptr_t)y->id ? -1 : 1;
+    return (x->seq < y->seq) - (x->seq > y->seq);      // 同一地址最新登记的在前
+}
+
+static const TraceName* trace_name_find(TraceName** names, size_t n, const void* id) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if ((uintptr_t)names[mid]->id < (uintptr_t)id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n && names[lo]->id == id ? names[lo] : NULL;
+}
+
+static void json_write_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", *s);
+        else fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/* LuaFFI.traceDump(path) -> n：以 Chrome trace-event JSON 写出各线程的事件，返回事件数 */
+int traceDump(lua_State* L) {
+    static const char* kinds[] = { "native", "lua", "luaMT" };
+    LUA_TYPE_ASSERT(L, string, 1);
+    const char* path = lua_tostring(L, 1);
+
+    TraceEvent* copy = malloc(TRACE_RING_SIZE * sizeof(TraceEvent));
+    LUA_ALLOC_ASSERT(L, copy);
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        free(copy);
+        luaL_error(L, "LuaFFI: cannot open %s", path);
+    }
+
+    /* 持锁期间名字表与环链表不变；各线程写入事件不受影响 */
+    pthread_mutex_lock(&__g_trace_lock);
+    size_t nnames = 0;
+    for (TraceName* n = __g_trace_names; n; n = n->next) nnames++;
+    TraceName** names = malloc((nnames + 1) * sizeof(TraceName*));
+    size_t k = 0;
+    if (names) {
+        for (TraceName* n = __g_trace_names; n; n = n->next) names[k++] = n;
+        qsort(names, nnames, sizeof(TraceName*), trace_name_compare);
+    }
+
+    long pid = (long)getpid();
+    lua_Integer count = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (TraceRing* r = __g_trace_rings; r; r = r->next) {
+        uint64_t h1 = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t lo = h1 > TRACE_RING_SIZE ? h1 - TRACE_RING_SIZE : 0;
+        if (lo < r->base) lo = r->base;
+        for (uint64_t i = lo; i < h1; i++)
+            copy[i & TRACE_RING_MASK] = r->ev[i & TRACE_RING_MASK];
+        /* 拷贝期间所属线程可能继续写入：只保留未被覆盖（或正在被覆盖）的事件 */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t h2 = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (h2 >= TRACE_RING_SIZE && lo < h2 - TRACE_RING_SIZE + 1) lo = h2 - TRACE_RING_SIZE + 1;
+
+        for (uint64_t i = lo; i < h1; i++) {
+            const TraceEvent* e = &copy[i & TRACE_RING_MASK];
+            if (e->ts < __g_trace_start) continue;
+            const TraceName* n = names ? trace_name_find(names, nnames, e->id) : NULL;
+            fprintf(f, "%s\n{\"name\":", count ? "," : "");
+            json_write_string(f, n ? n->name : "?");
+            fprintf(f, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%d}",
+                    n ? kinds[n->kind] : "unknown", e->phase,
+                    (double)(e->ts - __g_trace_start) / 1000.0, pid, e->tid);
+            count++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    pthread_mutex_unlock(&__g_trace_lock);
+
+    int failed = ferror(f);
+    if (fclose(f) != 0) failed = 1;
+    free(names);
+    free(copy);
+    if (failed) luaL_error(L, "LuaFFI: failed to write %s", path);
+    lua_pushinteger(L, count);
+    return 1;
+}
+
 int luaopen_LuaFFI(lua_State* L) {
     /* 初始化全局结构体映射（确保 __g_struct_map 已创建） */
     INIT_STRUCTMAP(32);
@@ -907,8 +3668,105 @@ int luaopen_LuaFFI(lua_State* L) {
     lua_setfield(L, -2, "__gc");
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, nativefunction_vcall);
+    lua_setfield(L, -2, "vcall");
+    lua_pushcfunction(L, nativefunction_batch);
+    lua_setfield(L, -2, "batch");
+    lua_pushcfunction(L, nativefunction_batch_into);
+    lua_setfield(L, -2, "batchInto");
+    lua_pushcfunction(L, nativefunction_return_views);
+    lua_setfield(L, -2, "returnViews");
+    lua_pushcfunction(L, nativefunction_async);
+    lua_setfield(L, -2, "async");
     lua_pop(L, 1);  /* 弹出元表 */
 
+    /* 创建 Signature 元表 */
+    luaL_newmetatable(L, "Signature");
+    lua_pushcfunction(L, signature_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, signature_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+
+    /* 创建 StructView 元表 */
+    luaL_newmetatable(L, "StructView");
+    lua_pushcfunction(L, structview_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, structview_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, structview_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, structview_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, structview_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+
+    /* 创建 MappedFile 元表（方法与 __index 共用元表） */
+    luaL_newmetatable(L, "MappedFile");
+    lua_pushcfunction(L, mappedfile_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, mappedfile_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, mappedfile_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, mappedfile_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, mappedfile_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, mappedfile_records);
+    lua_setfield(L, -2, "records");
+    lua_pushcfunction(L, mappedfile_advise);
+    lua_setfield(L, -2, "advise");
+    lua_pushcfunction(L, mappedfile_close);
+    lua_setfield(L, -2, "close");
+    lua_pop(L, 1);
+
+    /* 创建 AsyncCall 元表 */
+    luaL_newmetatable(L, "AsyncCall");
+    lua_pushcfunction(L, asynccall_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, asynccall_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, asynccall_done);
+    lua_setfield(L, -2, "done");
+    lua_pushcfunction(L, asynccall_wait);
+    lua_setfield(L, -2, "wait");
+    lua_pushcfunction(L, asynccall_await);
+    lua_setfield(L, -2, "await");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, "AsyncQueue");
+    lua_pushcfunction(L, asyncqueue_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    /* 创建 CallQueue 元表 */
+    luaL_newmetatable(L, "CallQueue");
+    lua_pushcfunction(L, callqueue_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    /* 创建 LuaClosure 元表 */
+    luaL_newmetatable(L, "LuaClosure");
+    lua_pushcfunction(L, luaclosure_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, luaclosure_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+
+    /* 创建 FieldAccessor 元表 */
+    luaL_newmetatable(L, "FieldAccessor");
+    lua_pushcfunction(L, fieldaccessor_call);
+    lua_setfield(L, -2, "__call");
+    lua_pushcfunction(L, fieldaccessor_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, fieldaccessor_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+
     /* 注册所有 API 函数到一张新表中 */
     lua_newtable(L);
 
@@ -921,6 +3779,12 @@ int luaopen_LuaFFI(lua_State* L) {
     lua_pushcfunction(L, unregisterStructType);
     lua_setfield(L, -2, "unregisterStruct");
 
+    lua_pushcfunction(L, registerArrayType);
+    lua_setfield(L, -2, "registerArray");
+
+    lua_pushcfunction(L, newSignature);
+    lua_setfield(L, -2, "signature");
+
     lua_pushcfunction(L, wrapNativeFunction);
     lua_setfield(L, -2, "wrapNative");
 
@@ -933,11 +3797,74 @@ int luaopen_LuaFFI(lua_State* L) {
     lua_pushcfunction(L, wrapLuaFunctionMT);
     lua_setfield(L, -2, "wrapLuaMT");
 
+    lua_pushcfunction(L, drainCallbacks);
+    lua_setfield(L, -2, "drain");
+
+    lua_pushcfunction(L, completedAsyncCalls);
+    lua_setfield(L, -2, "completed");
+
+    lua_pushcfunction(L, callQueueEventFd);
+    lua_setfield(L, -2, "eventfd");
+
+    lua_pushcfunction(L, configureThreadStates);
+    lua_setfield(L, -2, "configureThreadStates");
+
     lua_pushcfunction(L, unwrapLuaFunctionMT);
     lua_setfield(L, -2, "unwrapLuaMT");
 
     lua_pushcfunction(L, getString);
     lua_setfield(L, -2, "getString");
 
+    lua_pushcfunction(L, getLString);
+    lua_setfield(L, -2, "getLString");
+
+    lua_pushcfunction(L, getStringN);
+    lua_setfield(L, -2, "getStringN");
+
+    lua_pushcfunction(L, getStrings);
+    lua_setfield(L, -2, "getStrings");
+
+    lua_pushcfunction(L, newStructView);
+    lua_setfield(L, -2, "view");
+
+    lua_pushcfunction(L, structViewAddress);
+    lua_setfield(L, -2, "addressOf");
+
+    lua_pushcfunction(L, newFieldAccessor);
+    lua_setfield(L, -2, "accessor");
+
+    lua_pushcfunction(L, packStructArray);
+    lua_setfield(L, -2, "pack");
+
+    lua_pushcfunction(L, unpackStructArray);
+    lua_setfield(L, -2, "unpack");
+
+    lua_pushcfunction(L, mapFile);
+    lua_setfield(L, -2, "mapFile");
+
+    lua_pushcfunction(L, parallelMap);
+    lua_setfield(L, -2, "parallelMap");
+
+    lua_pushcfunction(L, parallelReduce);
+    lua_setfield(L, -2, "parallelReduce");
+
+    lua_pushcfunction(L, enableStats);
+    lua_setfield(L, -2, "enableStats");
+
+    lua_pushcfunction(L, callStats);
+    lua_setfield(L, -2, "stats");
+
+    lua_pushcfunction(L, resetStats);
+    lua_setfield(L, -2, "resetStats");
+
+    lua_pushcfunction(L, traceStart);
+    lua_setfield(L, -2, "traceStart");
+
+    lua_pushcfunction(L, traceStop);
+    lua_setfield(L, -2, "traceStop");
+
+    lua_pushcfunction(L, traceDump);
+    lua_setfield(L, -2, "traceDump");
+
     return 1;  /* 返回包含所有函数的表 */
 }
\ No newline at end of file
@@ -1,8 +1,13 @@
 #ifndef LUAFFI_H
 #define LUAFFI_H
+#include <stdint.h>
 #include "ffi.h"
 #include "StructMap.h"
 #include "LuaMap.h"
+#include "DirectCall.h"
+#include "ThreadPool.h"
+#include "CallStats.h"
+#include "Trace.h"
 
 #define MATCH_NATIVE_TYPE(type) (__native_type_map[type])
 #define VARIABLE ((ffi_type*) -1)
@@ -11,6 +16,23 @@
 extern "C" {
 #endif
 
+/* 字符串类型：与指针同布局，按地址与普通指针区分
+ * z：const char*，参数直接传递 Lua 字符串的内部指针，返回值压入字符串
+ * Z：展开为 (const char*, size_t) 两个 C 参数，对应一个 Lua 字符串 */
+static ffi_type __ffi_type_string = { sizeof(void*), sizeof(void*), FFI_TYPE_POINTER, NULL };
+static ffi_type __ffi_type_lstring = { sizeof(void*), sizeof(void*), FFI_TYPE_POINTER, NULL };
+#if SIZE_MAX > UINT32_MAX
+static ffi_type __ffi_type_lstring_len = { sizeof(size_t), sizeof(size_t), FFI_TYPE_UINT64, NULL };
+#else
+static ffi_type __ffi_type_lstring_len = { sizeof(size_t), sizeof(size_t), FFI_TYPE_UINT32, NULL };
+#endif
+
+/* 输出参数标记：后随被指向的类型，整体对应一个指针参数，存储分配在参数帧中
+ * &T：只输出，调用前清零，不占 Lua 参数；*T：输入输出，以对应的 Lua 参数初始化
+ * 调用后被指向的值依次追加在返回值之后 */
+static ffi_type __ffi_type_out = { sizeof(void*), sizeof(void*), FFI_TYPE_POINTER, NULL };
+static ffi_type __ffi_type_inout = { sizeof(void*), sizeof(void*), FFI_TYPE_POINTER, NULL };
+
 static ffi_type* __native_type_map[128] = {
     ['v'] = &ffi_type_void,
     ['c'] = &ffi_type_schar,
@@ -24,23 +46,153 @@ static ffi_type* __native_type_map[128] = {
     ['f'] = &ffi_type_float,
     ['d'] = &ffi_type_double,
     ['p'] = &ffi_type_pointer,
-    ['o'] = &ffi_type_longdouble
+    ['o'] = &ffi_type_longdouble,
+    ['z'] = &__ffi_type_string
 };
 
 static ffi_abi __g_abi = FFI_DEFAULT_ABI;
 
-/* ---------- NativeFunction 结构体 ---------- */
-typedef struct NativeFunction {
-    void*       func_ptr;       // 目标 C 函数指针
+/* ---------- 编组计划：签名预编译后的扁平转换步骤 ---------- */
+typedef void (*ToCFunc)(lua_State* L, int idx, void* out);
+typedef void (*ToLuaFunc)(lua_State* L, const void* in);
+
+enum { STEP_LEAF, STEP_ENTER, STEP_LEAVE, STEP_ARRAY, STEP_LSTRING, STEP_OUT, STEP_INOUT };
+
+typedef struct MarshalStep {
+    int         kind;           // STEP_LEAF 叶子字段 / STEP_ENTER、STEP_LEAVE 进出嵌套结构体 / STEP_ARRAY 整个数组 / STEP_LSTRING Z 参数 / STEP_OUT、STEP_INOUT 输出参数的指针
+    int         arg;            // 所属参数序号
+    int         lua_arg;        // 对应的 Lua 参数序号（Z 的长度参数不占 Lua 参数）
+    int         field;          // 在父表中的位置（1 起，顶层参数为 0）
+    const char* name;           // 父结构体注册了字段名时的字段名，否则为 NULL
+    int         nfields;        // STEP_ENTER：结构体字段数，用于预分配表；STEP_ARRAY：元素个数
+    int         skip;           // STEP_ENTER：到对应 STEP_LEAVE 的步数（传入结构体视图时整体拷贝并跳过）
+    ffi_type*   type;           // STEP_ENTER / STEP_ARRAY：结构体或数组类型；STEP_OUT / STEP_INOUT：被指向的类型
+    size_t      stride;         // STEP_ARRAY：元素间距
+    size_t      offset;         // 相对参数起始地址的字节偏移（已按 Structure.offsets 展开；输出参数的存储相对其指针参数）
+    ToCFunc     to_c;           // STEP_LEAF / 标量元素的 STEP_ARRAY：Lua -> C 转换函数
+    ToLuaFunc   to_lua;         // STEP_LEAF / 标量元素的 STEP_ARRAY：C -> Lua 转换函数
+} MarshalStep;
+
+typedef struct MarshalPlan {
+    MarshalStep* steps;         // 按参数顺序线性排列的步骤
+    int          nsteps;
+    int          depth;         // 最大结构体嵌套深度（所需额外栈槽）
+    int          nlua;          // Lua 侧参数个数（输出计划为追加的返回值个数）
+    size_t*      arg_offsets;   // 每个参数在连续参数帧中的偏移
+    size_t       frame_size;    // 参数帧总大小
+} MarshalPlan;
+
+/* ---------- Signature 结构体（按签名文本驻留，相同签名共享同一句柄） ---------- */
+typedef struct Signature {
+    char*       text;           // 签名原文，驻留表的键
+    size_t      hash;           // text 的哈希值
+    ffi_type**  types;          // parse_string_fsm 返回的原始数组 [ret, args..., NULL]，持有其中结构体的引用
     ffi_type*   ret_type;       // 返回值类型
-    ffi_type**  fixed_types;    // 固定参数类型数组（原始，未经提升）
+    ffi_type**  arg_types;      // 固定参数类型数组（指向 types+1；含输出参数时另行分配，输出参数为指针）
     int         nfixed;         // 固定参数个数
+    int         is_variadic;    // 是否含 ... 标记
     ffi_type*   var_promoted;   // 可变参数提升后的类型（仅当 is_variadic）
-    int         is_variadic;    // 是否为可变参数函数
     ffi_cif     cif;            // 非可变参数时预先生成
-    ffi_type**  sign_base;      // parse_string_fsm 返回的原始数组，用于释放
+    DirectThunk thunk;          // 标量签名的直接调用桩（不适用时为 NULL）
+    MarshalPlan args_plan;      // 固定参数的编组计划
+    MarshalPlan ret_plan;       // 返回值的编组计划（void 时为空）
+    MarshalPlan out_plan;       // 输出参数的编组计划，调用后追加在返回值之后（无输出参数时为空）
+    size_t      ret_size;       // 返回值缓冲区大小（至少 sizeof(ffi_arg)）
+    int         refcount;       // 引用计数（驻留表、绑定、Lua 句柄各持有一个）
+    struct Signature* next;     // 驻留表链
+} Signature;
+
+/* ---------- VarCall 结构体（可变参数调用的 cif 缓存项） ---------- */
+typedef struct VarCall {
+    int         nvar;           // 可变参数个数
+    int         nfixed;         // 固定参数个数
+    char*       key;            // 类型注解文本（按个数缓存时为 NULL）
+    ffi_type**  arg_types;      // 完整参数类型数组 [固定参数..., 可变参数...]，持有可变参数中结构体的引用
+    ffi_cif     cif;            // 预先生成的 ffi_cif
+    MarshalPlan plan;           // 全部参数的编组计划
+    struct VarCall* next;
+} VarCall;
+
+#define VAR_CACHE_SLOTS 16      // 按可变参数个数直接索引的缓存槽
+#define VAR_TYPED_MAX   16      // 按类型注解缓存的最大项数
+
+/* ---------- NativeFunction 结构体 ---------- */
+typedef struct NativeFunction {
+    void*       func_ptr;       // 目标 C 函数指针
+    Signature*  sig;            // 共享的签名句柄（持有一个引用）
+    VarCall*    var_cache[VAR_CACHE_SLOTS]; // 可变参数：按个数缓存的 cif
+    VarCall*    var_typed;      // 可变参数：按类型注解（或较大个数）缓存的 cif 链表
+    int         ret_view;       // 结构体返回值以 StructView 返回而非 Lua 表
+    CallStats*  stats;          // 调用统计（开启统计后首次调用时创建）
+    unsigned    trace_epoch;    // 已在该次追踪中登记名字时等于 __g_trace_epoch
 } NativeFunction;
 
+/* ---------- AsyncJob 结构体（nf:async 在工作线程执行的一次调用） ---------- */
+typedef struct AsyncJob {
+    void*       func_ptr;       // 目标 C 函数指针
+    Signature*  sig;            // 持有一个引用，调用期间不依赖 NativeFunction 存活
+    void**      args;           // 参数指针数组（与参数帧、返回值缓冲区同一块分配）
+    void*       ret;            // 返回值缓冲区（void 时为 NULL）
+    int         ret_view;       // 结构体返回值以 StructView 返回
+    int         done;           // 完成标志（原子读写）
+    int         refcount;       // 句柄与完成队列各持有一个引用
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    struct AsyncQueue* queue;   // 所属 Lua 状态的完成队列
+    struct AsyncJob*   next;    // 完成队列链
+} AsyncJob;
+
+/* ---------- AsyncQueue 结构体（每个 Lua 状态一个，工作线程在此登记完成的调用） ---------- */
+typedef struct AsyncQueue {
+    pthread_mutex_t lock;
+    AsyncJob*   head;
+    AsyncJob*   tail;
+    int         refcount;       // 注册表中的句柄与每个未释放的 AsyncJob 各持有一个引用
+} AsyncQueue;
+
+#define ARRAY_EXPAND_MAX_SIZE 64  // 不超过该字节数的数组为 libffi 展开完整元素列表（按值传递分类需要）
+
+/* ---------- 调用暂存区（每线程 bump 分配器，存放参数帧与返回值缓冲区） ---------- */
+#define SCRATCH_SIZE    (64 * 1024) // 每线程暂存区字节数，超出时退回 GC 管理的 userdata
+#define SCRATCH_MARKS   128         // 最大嵌套调用层数（回调中再次调用 C 函数）
+#define SCRATCH_ALIGN   16
+
+typedef struct ScratchMark {
+    const void* owner;          // 分配者的栈地址，用于识别因 longjmp 未释放的帧
+    size_t      top;            // 分配前的栈顶
+} ScratchMark;
+
+typedef struct ScratchArena {
+    char*       base;
+    size_t      top;
+    int         nmarks;
+    ScratchMark marks[SCRATCH_MARKS];
+} ScratchArena;
+
+/* ---------- StructView 结构体（以 C 内存为后端的结构体视图） ---------- */
+typedef struct StructView {
+    Structure*  st;             // 结构体类型（持有一个引用）
+    char*       ptr;            // 结构体内存（自有视图指向紧随其后的内联存储）
+} StructView;
+
+/* ---------- MappedFile 结构体（按记录类型访问的内存映射文件） ---------- */
+typedef struct MappedFile {
+    Structure*  st;             // 记录类型（持有一个引用）
+    char*       base;           // 映射起始地址（空文件为 NULL）
+    size_t      length;         // 映射字节数
+    size_t      count;          // 完整记录个数
+    size_t      stride;         // 记录间距（结构体大小）
+    int         writable;       // "w" 模式：修改写回文件
+    int         closed;         // close 后为 1，文件已解除映射
+} MappedFile;
+
+/* ---------- FieldAccessor 结构体（预解析的字段访问句柄） ---------- */
+typedef struct FieldAccessor {
+    Structure*  st;             // 所属结构体（持有一个引用）
+    ffi_type*   type;           // 字段类型
+    size_t      offset;         // 相对结构体起始地址的字节偏移（支持嵌套路径累加）
+} FieldAccessor;
+
 int luaopen_LuaFFI(lua_State* L);
 
 #ifdef __cplusplus
@@ -5,98 +5,348 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include "XShare.h"
 
-/* ---------- 线程局部 Lua 状态管理 ---------- */
+/* ---------- 线程局部 Lua 状态管理 ----------
+ * 每个线程的 Lua 状态在栈索引 1 处保留一张缓存表：槽位 id + 1 -> 已还原的 Lua 函数，
+ * gens[id] 记录缓存时闭包的代号，与闭包当前代号不符即视为失效。 */
+typedef struct ThreadCtx {
+    lua_State* L;
+    unsigned* gens;             // 每个闭包槽位已缓存函数的代号（0 表示未缓存）
+    int ngens;
+    unsigned config_gen;        // 创建时的线程状态配置代号
+    struct ThreadCtx* next;     // 状态池链
+} ThreadCtx;
+
+/* ---------- 线程状态配置与预热池（configureThreadStates） ---------- */
+typedef struct ThreadStateConfig {
+    unsigned libs;              // 打开的标准库位掩码（THREAD_LIB_*）
+    char* init;                 // 初始化代码块的字节码（lua_dump 结果），可为 NULL
+    size_t init_len;
+    int pool_max;               // 池中保留的已初始化状态上限
+    unsigned gen;               // 配置代号，配置变化后旧状态不再入池
+    ThreadCtx* pool;            // 空闲的已初始化状态
+    int npool;
+    pthread_mutex_t lock;
+} ThreadStateConfig;
+
+#define THREAD_LIB_ALL 0xFFFFu
+
+static ThreadStateConfig __g_state_config = {
+    THREAD_LIB_ALL, NULL, 0, 0, 1, NULL, 0, PTHREAD_MUTEX_INITIALIZER
+};
+
 static pthread_key_t lua_state_key;
 static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 
+static void thread_ctx_close(ThreadCtx* ctx) {
+    lua_close(ctx->L);
+    free(ctx->gens);
+    free(ctx);
+}
+
+/* 线程退出时：配置未变且池未满则归还状态（保留其函数缓存），否则关闭 */
+static void thread_ctx_free(void* p) {
+    ThreadCtx* ctx = (ThreadCtx*)p;
+    ThreadStateConfig* cfg = &__g_state_config;
+    pthread_mutex_lock(&cfg->lock);
+    if (ctx->config_gen == cfg->gen && cfg->npool < cfg->pool_max) {
+        ctx->next = cfg->pool;
+        cfg->pool = ctx;
+        cfg->npool++;
+        ctx = NULL;
+    }
+    pthread_mutex_unlock(&cfg->lock);
+    if (ctx) thread_ctx_close(ctx);
+}
+
 static void create_key(void) {
-    pthread_key_create(&lua_state_key, (void(*)(void*))lua_close);
+    pthread_key_create(&lua_state_key, thread_ctx_free);
 }
 
 /* ---------- 多线程闭包信息结构体 ---------- */
 typedef struct LuaClosureInfoMT {
     StoredObject* func_obj;   // 序列化后的 Lua 函数
-    ffi_type* ret_type;       // 返回值类型
-    ffi_type** arg_types;     // 参数类型数组（指向 sign_base+1）
-    int nargs;                // 参数个数
+    struct Signature* sig;    // 共享的签名句柄（含预先生成的 ffi_cif）
     void* writable;           // 可写地址（用于 ffi_closure_free）
-    ffi_cif cif;              // 预先生成的 ffi_cif
-    ffi_type** sign_base;     // parse_string_fsm 返回的原始数组，用于释放
+    int cache_slot;           // 线程缓存表中的槽位（即闭包槽位 id）
+    unsigned cache_gen;       // 代号，每次包装递增，释放时清零使各线程缓存失效
+    struct CallStats* stats;  // 调用统计（开启统计后首次调用时创建）
+    unsigned trace_epoch;     // 已在该次追踪中登记名字时等于 __g_trace_epoch
 } LuaClosureInfoMT;
 
-/* ---------- 全局映射：可执行地址 -> LuaClosureInfoMT ---------- */
-typedef struct MapEntryMT {
-    void* code;
-    LuaClosureInfoMT* info;
-    struct MapEntryMT* next;
-} MapEntryMT;
-
-static MapEntryMT* map_mt[256];
-static pthread_mutex_t map_mutex_mt = PTHREAD_MUTEX_INITIALIZER;
-
 /* ---------- LuaClosureInfo 结构体 ---------- */
 typedef struct LuaClosureInfo {
     lua_State* L;               // Lua 状态
     int func_ref;                // 函数在注册表中的引用
-    ffi_type* ret_type;          // 返回值类型
-    ffi_type** arg_types;        // 参数类型数组（指向 sign_base+1）
-    int nargs;                   // 参数个数
+    struct Signature* sig;       // 共享的签名句柄（含预先生成的 ffi_cif）
     void* writable;              // 可写地址（用于 ffi_closure_free）
-    ffi_cif cif;                 // 预先生成的 ffi_cif
-    ffi_type** sign_base;        // parse_string_fsm 返回的原始数组，用于释放
     pthread_t tid;   // 新增：创建该闭包的线程 ID
+    int cross;                   // 其他线程调用时的处理方式（CROSS_*）
+    struct CallQueue* queue;     // cross 非 CROSS_NONE 时，所属 Lua 状态的调用队列
+    struct CallStats* stats;     // 调用统计（开启统计后首次调用时创建）
+    unsigned trace_epoch;        // 已在该次追踪中登记名字时等于 __g_trace_epoch
+    int refcount;                // 闭包本身与每个排队中的跨线程调用各持有一个引用
 } LuaClosureInfo;
 
-/* ---------- 全局映射：可执行地址 -> LuaClosureInfo ---------- */
-typedef struct MapEntry {
+/* ---------- 跨线程调用队列：其他线程的回调排队，由所属线程 LuaFFI.drain 批量执行 ---------- */
+enum { CROSS_NONE, CROSS_BLOCK, CROSS_POST };
+
+#define CALL_QUEUE_SIZE 1024        // 环形队列容量（2 的幂）
+
+typedef struct CallEvent {
+    LuaClosureInfo* info;
+    void** args;                // 参数指针数组（POST 时指向事件内的拷贝）
+    void* ret;                  // 返回值缓冲区（仅 BLOCK）
+    int blocking;
+    int done;                   // BLOCK：执行完成标志
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} CallEvent;
+
+typedef struct CallSlot {
+    size_t seq;                 // 序号：等于写入位置表示空闲，等于位置 + 1 表示已写入
+    CallEvent* ev;
+} CallSlot;
+
+/* 有界多生产者单消费者环形队列（按槽位序号同步，生产者 CAS 竞争 tail） */
+typedef struct CallQueue {
+    size_t tail;                            // 生产者
+    char pad0[64 - sizeof(size_t)];
+    size_t head;                            // 消费者（所属线程）
+    char pad1[64 - sizeof(size_t)];
+    int efd;                                // 唤醒用 eventfd（不支持时为 -1）
+    int pending;                            // 已写 eventfd 且尚未被 drain
+    CallSlot slots[CALL_QUEUE_SIZE];
+} CallQueue;
+
+static void call_queue_init(CallQueue* q) {
+    memset(q, 0, sizeof(CallQueue));
+    for (size_t i = 0; i < CALL_QUEUE_SIZE; i++) q->slots[i].seq = i;
+#ifdef __linux__
+    q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    q->efd = -1;
+#endif
+}
+
+/* 入队，队列满时让出 CPU 等待消费者 */
+static void call_queue_push(CallQueue* q, CallEvent* ev) {
+    for (;;) {
+        size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        CallSlot* slot = &q->slots[pos & (CALL_QUEUE_SIZE - 1)];
+        intptr_t dif = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->ev = ev;
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                break;
+            }
+        } else if (dif < 0) {
+            sched_yield();          // 已满
+        }
+    }
+    /* 仅在队列从“已处理”变为“待处理”时写 eventfd，合并唤醒 */
+    if (q->efd >= 0 && __atomic_exchange_n(&q->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint64_t one = 1;
+        ssize_t n = write(q->efd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+/* 出队（仅所属线程调用），队列空时返回 NULL */
+static CallEvent* call_queue_pop(CallQueue* q) {
+    CallSlot* slot = &q->slots[q->head & (CALL_QUEUE_SIZE - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->head + 1) return NULL;
+    CallEvent* ev = slot->ev;
+    __atomic_store_n(&slot->seq, q->head + CALL_QUEUE_SIZE, __ATOMIC_RELEASE);
+    q->head++;
+    return ev;
+}
+
+/* ---------- 闭包注册表：可执行地址 -> 闭包信息 ----------
+ * 开放寻址 + 线性探测。查找不加锁：写者先写 info 再以 release 语义发布 code，
+ * 读者读到 info 后复核 code 未变；插入、删除与扩容由写锁串行化。
+ * 扩容时新表构建完成后才发布，旧表挂在 retired 链上不释放（几何增长，总量不超过当前表）。 */
+#define REGISTRY_EMPTY      ((void*)0)
+#define REGISTRY_TOMBSTONE  ((void*)1)
+#define REGISTRY_MIN_BITS   8
+
+typedef struct RegistrySlot {
     void* code;
-    struct LuaClosureInfo* info;
-    struct MapEntry* next;
-} MapEntry;
-
-static MapEntry* map[256];
-static pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static void map_insert(void* code, struct LuaClosureInfo* info) {
-    unsigned int h = (unsigned long)code % 256;
-    pthread_mutex_lock(&map_mutex);
-    MapEntry* e = malloc(sizeof(MapEntry));
-    e->code = code;
-    e->info = info;
-    e->next = map[h];
-    map[h] = e;
-    pthread_mutex_unlock(&map_mutex);
+    void* info;
+} RegistrySlot;
+
+typedef struct RegistryTable {
+    size_t mask;                    // 容量 - 1
+    int shift;                      // 64 - log2(容量)
+    struct RegistryTable* retired;  // 被替换的旧表
+    RegistrySlot slots[];
+} RegistryTable;
+
+typedef struct ClosureRegistry {
+    RegistryTable* table;
+    size_t count;                   // 存活项数
+    size_t used;                    // 存活项 + 墓碑数
+    pthread_mutex_t lock;           // 写锁
+} ClosureRegistry;
+
+static ClosureRegistry __g_closures = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+static ClosureRegistry __g_closures_mt = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* 闭包地址按 16 字节对齐，先去掉低位再做 Fibonacci 散列，取高位作为下标 */
+static inline size_t registry_hash(const RegistryTable* t, const void* code) {
+    uint64_t h = ((uint64_t)(uintptr_t)code >> 4) * 11400714819323198485ULL;
+    return (size_t)(h >> t->shift);
+}
+
+static RegistryTable* registry_table_new(int bits) {
+    size_t cap = (size_t)1 << bits;
+    RegistryTable* t = calloc(1, sizeof(RegistryTable) + cap * sizeof(RegistrySlot));
+    if (!t) return NULL;
+    t->mask = cap - 1;
+    t->shift = 64 - bits;
+    return t;
+}
+
+/* 写锁内调用：必要时扩容或清理墓碑，失败返回 0 */
+static int registry_reserve(ClosureRegistry* reg) {
+    RegistryTable* old = reg->table;
+    if (old && (reg->used + 1) * 4 < (old->mask + 1) * 3) return 1;
+
+    int bits = old ? 64 - old->shift : REGISTRY_MIN_BITS;
+    if (old && (reg->count + 1) * 2 >= old->mask + 1) bits++;   // 墓碑不多时才真正扩大
+    RegistryTable* t = registry_table_new(bits);
+    if (!t) return 0;
+    if (old) {
+        for (size_t i = 0; i <= old->mask; i++) {
+            void* code = old->slots[i].code;
+            if (code == REGISTRY_EMPTY || code == REGISTRY_TOMBSTONE) continue;
+            size_t j = registry_hash(t, code);
+            while (t->slots[j].code) j = (j + 1) & t->mask;
+            t->slots[j] = old->slots[i];
+        }
+        t->retired = old;
+    }
+    reg->used = reg->count;
+    ATOMIC_STORE(&reg->table, t);
+    return 1;
+}
+
+static int registry_insert(ClosureRegistry* reg, void* code, void* info) {
+    pthread_mutex_lock(&reg->lock);
+    if (!registry_reserve(reg)) {
+        pthread_mutex_unlock(&reg->lock);
+        return 0;
+    }
+    RegistryTable* t = reg->table;
+    size_t i = registry_hash(t, code);
+    while (t->slots[i].code != REGISTRY_EMPTY && t->slots[i].code != REGISTRY_TOMBSTONE)
+        i = (i + 1) & t->mask;
+    if (t->slots[i].code == REGISTRY_EMPTY) reg->used++;
+    ATOMIC_STORE(&t->slots[i].info, info);
+    ATOMIC_STORE(&t->slots[i].code, code);
+    reg->count++;
+    pthread_mutex_unlock(&reg->lock);
+    return 1;
 }
 
-static struct LuaClosureInfo* map_find(void* code) {
-    unsigned int h = (unsigned long)code % 256;
-    pthread_mutex_lock(&map_mutex);
-    MapEntry* e = map[h];
-    while (e) {
-        if (e->code == code) {
-            pthread_mutex_unlock(&map_mutex);
-            return e->info;
+/* 无锁查找 */
+static inline void* registry_find(ClosureRegistry* reg, void* code) {
+    RegistryTable* t = ATOMIC_LOAD(&reg->table);
+    if (!t) return NULL;
+    for (size_t i = registry_hash(t, code); ; i = (i + 1) & t->mask) {
+        void* k = ATOMIC_LOAD(&t->slots[i].code);
+        if (k == REGISTRY_EMPTY) return NULL;
+        if (k == code) {
+            void* info = ATOMIC_LOAD(&t->slots[i].info);
+            if (ATOMIC_LOAD(&t->slots[i].code) == code) return info;
         }
-        e = e->next;
     }
-    pthread_mutex_unlock(&map_mutex);
-    return NULL;
 }
 
-static void map_remove(void* code) {
-    unsigned int h = (unsigned long)code % 256;
-    pthread_mutex_lock(&map_mutex);
-    MapEntry** p = &map[h];
-    while (*p) {
-        if ((*p)->code == code) {
-            MapEntry* tmp = *p;
-            *p = (*p)->next;
-            free(tmp);
-            break;
+/* 查找并删除（一次加锁），返回被删除项的 info，未找到返回 NULL */
+static void* registry_take(ClosureRegistry* reg, void* code) {
+    void* info = NULL;
+    pthread_mutex_lock(&reg->lock);
+    RegistryTable* t = reg->table;
+    if (t) {
+        for (size_t i = registry_hash(t, code); t->slots[i].code; i = (i + 1) & t->mask) {
+            if (t->slots[i].code == code) {
+                info = t->slots[i].info;
+                ATOMIC_STORE(&t->slots[i].code, REGISTRY_TOMBSTONE);
+                reg->count--;
+                break;
+            }
         }
-        p = &(*p)->next;
     }
-    pthread_mutex_unlock(&map_mutex);
+    pthread_mutex_unlock(&reg->lock);
+    return info;
 }
+
+/* ---------- 闭包槽池：预先分配的 ffi_closure 连同闭包信息一起回收复用 ----------
+ * wrap/unwrap 只做空闲链表的取出与归还，可执行页仅在整批补充时由 ffi_closure_alloc 映射。 */
+#define CLOSURE_SLAB 64
+
+typedef struct ClosureSlot {
+    ffi_closure* writable;          // 可写地址
+    void* code;                     // 可执行地址
+    struct ClosureSlot* next;       // 空闲链
+    int id;                         // 槽位编号（全局唯一，用作线程缓存表下标）
+    union {
+        LuaClosureInfo lua;
+        LuaClosureInfoMT mt;
+    } info;
+} ClosureSlot;
+
+static ClosureSlot* __g_closure_free = NULL;
+static int __g_closure_ids = 0;
+static unsigned __g_closure_gen = 0;
+static pthread_mutex_t __g_closure_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 锁内调用：补充一批槽位，槽位数组与 closure 均不释放 */
+static int closure_pool_refill(void) {
+    ClosureSlot* slab = calloc(CLOSURE_SLAB, sizeof(ClosureSlot));
+    if (!slab) return 0;
+    int n = 0;
+    for (int i = 0; i < CLOSURE_SLAB; i++) {
+        ClosureSlot* slot = &slab[i];
+        slot->writable = ffi_closure_alloc(sizeof(ffi_closure), &slot->code);
+        if (!slot->writable) break;
+        slot->id = __g_closure_ids++;
+        slot->next = __g_closure_free;
+        __g_closure_free = slot;
+        n++;
+    }
+    if (n == 0) free(slab);
+    return n;
+}
+
+static ClosureSlot* closure_slot_acquire(void) {
+    pthread_mutex_lock(&__g_closure_pool_lock);
+    ClosureSlot* slot = __g_closure_free;
+    if (!slot && closure_pool_refill()) slot = __g_closure_free;
+    if (slot) __g_closure_free = slot->next;
+    pthread_mutex_unlock(&__g_closure_pool_lock);
+    return slot;
+}
+
+static void closure_slot_release(ClosureSlot* slot) {
+    pthread_mutex_lock(&__g_closure_pool_lock);
+    slot->next = __g_closure_free;
+    __g_closure_free = slot;
+    pthread_mutex_unlock(&__g_closure_pool_lock);
+}
+
+/* ---------- LuaClosure 句柄（wrapLua 的 managed 选项，__gc 时自动释放） ---------- */
+typedef struct LuaClosureHandle {
+    void* code;                     // 可执行地址，已释放时为 NULL
+    int mt;                         // 是否为 wrapLuaMT 创建
+} LuaClosureHandle;
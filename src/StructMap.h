@@ -2,30 +2,24 @@
 #include "stdlib.h"
 #include "string.h"
 #include "pthread.h"
+#include <sched.h>
 #include <stddef.h>
 
-typedef struct {
+typedef struct Structure {
     ffi_type type;
     size_t* offsets;
     char* name;
+    size_t name_len;    // 名字长度（查找时先比较长度）
+    int nfields;        // 字段个数
+    char** field_names; // 字段名（未命名时为 NULL），名字与指针数组同一块分配
+    int* field_slots;   // 字段名开放寻址表，存放 字段序号 + 1（0 表示空槽）
+    size_t field_mask;  // field_slots 容量 - 1
+    ffi_type* elem;     // 数组类型：元素类型（结构体为 NULL）
+    size_t stride;      // 数组类型：元素间距，字段 i 的偏移为 i * stride，offsets 为 NULL
+    size_t hash;        // 名字的哈希值
+    int refcount;       // 映射表、签名、视图、访问器及外层结构体各持有一个引用
 } Structure;
 
-typedef struct Node {
-    char* key;
-    Structure type;
-    struct Node* next;
-} Node;
-
-typedef struct {
-    Node** buckets;
-    size_t size;
-    size_t count;
-    pthread_rwlock_t lock;  // 改用读写锁提高并发性能
-} StructMap;
-
-// 全局哈希表实例
-static StructMap* __g_struct_map = NULL;
-
 // 检查编译器是否支持 GNU C 扩展
 #ifdef __GNUC__
     #define HAS_GNU_EXTENSIONS 1
@@ -33,377 +27,353 @@ static StructMap* __g_struct_map = NULL;
     #define HAS_GNU_EXTENSIONS 0
 #endif
 
-// ==================== 原子操作和内存屏障 ====================
-#if HAS_GNU_EXTENSIONS
-// 使用 GCC 内置原子操作进行无锁读
+// ==================== 原子操作 ====================
+// 使用 GCC 内置原子操作进行无锁读（LuaMap.h 的闭包注册表共用）。
+// 无锁映射表与纪元回收直接使用 __atomic_* 内置函数，不再提供 stdatomic 回退
+#if !HAS_GNU_EXTENSIONS
+#error "LuaFFI requires a compiler with GNU C __atomic builtins (GCC or Clang)"
+#endif
 #define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
 #define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
-#else
-// 回退方案：使用 volatile 和内存屏障
-#include <stdatomic.h>
-#define ATOMIC_LOAD(p) atomic_load_explicit((atomic_size_t*)(p), memory_order_acquire)
-#define ATOMIC_STORE(p, v) atomic_store_explicit((atomic_size_t*)(p), (v), memory_order_release)
-#endif
 
-// ==================== 哈希函数 ====================
-static inline size_t hash_str(const char* key) {
+// ==================== 哈希函数（FNV-1a，结构体映射表、签名驻留表与字段名表共用） ====================
+static inline size_t hash_str_n(const char* key, size_t len) {
     size_t h = 14695981039346656037ULL;
-    unsigned char c;
-    while ((c = (unsigned char)*key++)) {
-        h = (h ^ c) * 1099511628211ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
     }
     return h;
 }
 
-// ==================== 节点操作 ====================
-static inline Node* hash_node_create(const char* key, Structure type) {
-    Node* node = (Node*) malloc(sizeof(Node));
-    if (!node) return NULL;
-    
-    node->key = strdup(key); // 使用 strdup 简化代码
-    if (!node->key) {
-        free(node);
+static inline size_t hash_str(const char* key) {
+    return hash_str_n(key, strlen(key));
+}
+
+// ==================== 基于纪元的延迟回收 ====================
+/* 读者在 epoch_enter/epoch_exit 之间访问共享结构，不加锁也不修改引用计数；
+ * 写者摘除的对象以当前纪元登记，全局纪元前进两次后（可能看到它的读者都已退出）才释放。 */
+typedef struct EpochRecord {
+    unsigned epoch;             // 读者进入时的全局纪元，0 表示不在读临界区
+    int depth;                  // 嵌套深度
+    int in_use;                 // 线程退出后为 0，可被新线程复用
+    struct EpochRecord* next;
+} EpochRecord;
+
+typedef struct Retired {
+    void* ptr;
+    void (*free_fn)(void*);
+    unsigned epoch;
+    struct Retired* next;
+} Retired;
+
+static unsigned __g_epoch = 1;
+static EpochRecord* __g_epoch_records = NULL;
+static Retired* __g_retired = NULL;
+static pthread_mutex_t __g_epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t __g_epoch_key;
+static pthread_once_t __g_epoch_once = PTHREAD_ONCE_INIT;
+static __thread EpochRecord* __t_epoch_record = NULL;
+
+static void epoch_thread_exit(void* p) {
+    __atomic_store_n(&((EpochRecord*)p)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_key_init(void) {
+    pthread_key_create(&__g_epoch_key, epoch_thread_exit);
+}
+
+static EpochRecord* epoch_record(void) {
+    if (__t_epoch_record) return __t_epoch_record;
+    pthread_once(&__g_epoch_once, epoch_key_init);
+    pthread_mutex_lock(&__g_epoch_lock);
+    EpochRecord* r = __g_epoch_records;
+    while (r && __atomic_load_n(&r->in_use, __ATOMIC_ACQUIRE)) r = r->next;
+    if (!r && (r = calloc(1, sizeof(EpochRecord)))) {
+        r->next = __g_epoch_records;
+        __g_epoch_records = r;
+    }
+    if (r) __atomic_store_n(&r->in_use, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&__g_epoch_lock);
+    if (r) pthread_setspecific(__g_epoch_key, r);
+    return __t_epoch_record = r;
+}
+
+/* 进入读临界区；无法分配线程记录时退化为持有回收锁（返回 NULL） */
+static inline EpochRecord* epoch_enter(void) {
+    EpochRecord* r = epoch_record();
+    if (!r) {
+        pthread_mutex_lock(&__g_epoch_lock);
         return NULL;
     }
-    node->type = type;
-    node->next = NULL;
-    return node;
+    if (r->depth++ == 0) {
+        __atomic_store_n(&r->epoch, __atomic_load_n(&__g_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    return r;
 }
 
-static inline void hash_node_free(Node* node) {
-    if (node) {
-        free(node->key);
-        free(node->type.offsets);
-        free(node->type.name);
-        free(node->type.type.elements);
-        free(node);
+static inline void epoch_exit(EpochRecord* r) {
+    if (!r) {
+        pthread_mutex_unlock(&__g_epoch_lock);
+        return;
     }
+    if (--r->depth == 0)
+        __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
 }
 
-// ==================== 锁优化辅助函数 ====================
-// 自动锁管理，确保异常安全
-#if HAS_GNU_EXTENSIONS
-#define WITH_READ_LOCK(map) \
-    pthread_rwlock_rdlock(&(map)->lock); \
-    __attribute__((cleanup(__auto_unlock_read))) \
-    pthread_rwlock_t* __lock_ptr = &(map)->lock
-
-#define WITH_WRITE_LOCK(map) \
-    pthread_rwlock_wrlock(&(map)->lock); \
-    __attribute__((cleanup(__auto_unlock_write))) \
-    pthread_rwlock_t* __lock_ptr = &(map)->lock
-
-// 自动解锁函数
-static inline void __auto_unlock_read(pthread_rwlock_t** lock) {
-    if (*lock) pthread_rwlock_unlock(*lock);
+/* 持有 __g_epoch_lock 时调用：所有读者都已看到当前纪元则前进一步，摘出已安全的对象。
+ * 返回摘出的链表，由调用方解锁后以 epoch_free_list 释放（free_fn 可能再次登记回收，如外层结构体释放内层引用） */
+static Retired* epoch_collect_locked(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned e = __atomic_load_n(&__g_epoch, __ATOMIC_RELAXED);
+    int advance = 1;
+    for (EpochRecord* r = __g_epoch_records; r; r = r->next) {
+        unsigned re = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+        if (re && re != e) { advance = 0; break; }
+    }
+    if (advance) __atomic_store_n(&__g_epoch, ++e, __ATOMIC_RELEASE);
+
+    Retired* expired = NULL;
+    Retired** link = &__g_retired;
+    while (*link) {
+        Retired* item = *link;
+        if ((int)(e - item->epoch) >= 2) {
+            *link = item->next;
+            item->next = expired;
+            expired = item;
+        } else {
+            link = &item->next;
+        }
+    }
+    return expired;
 }
 
-static inline void __auto_unlock_write(pthread_rwlock_t** lock) {
-    if (*lock) pthread_rwlock_unlock(*lock);
+/* 不持有 __g_epoch_lock 时调用 */
+static void epoch_free_list(Retired* item) {
+    while (item) {
+        Retired* next = item->next;
+        item->free_fn(item->ptr);
+        free(item);
+        item = next;
+    }
 }
-#else
-// 非 GNU C 回退方案
-typedef struct {
-    StructMap* map;
-    int is_write;
-} AutoLock;
 
-static inline void auto_lock_cleanup(AutoLock* al) {
-    if (al->map) pthread_rwlock_unlock(&al->map->lock);
+/* 登记待回收对象；无法分配登记项时等待纪元前进两次后直接释放（不可在读临界区内调用） */
+static void epoch_retire(void* ptr, void (*free_fn)(void*)) {
+    Retired* item = malloc(sizeof(Retired));
+    pthread_mutex_lock(&__g_epoch_lock);
+    if (item) {
+        item->ptr = ptr;
+        item->free_fn = free_fn;
+        item->epoch = __atomic_load_n(&__g_epoch, __ATOMIC_RELAXED);
+        item->next = __g_retired;
+        __g_retired = item;
+        Retired* expired = epoch_collect_locked();
+        pthread_mutex_unlock(&__g_epoch_lock);
+        epoch_free_list(expired);
+        return;
+    }
+
+    unsigned target = __atomic_load_n(&__g_epoch, __ATOMIC_RELAXED) + 2;
+    Retired* expired = epoch_collect_locked();
+    while ((int)(__atomic_load_n(&__g_epoch, __ATOMIC_RELAXED) - target) < 0) {
+        pthread_mutex_unlock(&__g_epoch_lock);
+        epoch_free_list(expired);
+        sched_yield();
+        pthread_mutex_lock(&__g_epoch_lock);
+        expired = epoch_collect_locked();
+    }
+    pthread_mutex_unlock(&__g_epoch_lock);
+    epoch_free_list(expired);
+    free_fn(ptr);
 }
 
-#define WITH_READ_LOCK(map) \
-    pthread_rwlock_rdlock(&(map)->lock); \
-    AutoLock __al = {map, 0}; \
-    (void)__al
+// ==================== Structure 引用计数 ====================
+static inline void structure_retain(Structure* st) {
+    __atomic_add_fetch(&st->refcount, 1, __ATOMIC_RELAXED);
+}
 
-#define WITH_WRITE_LOCK(map) \
-    pthread_rwlock_wrlock(&(map)->lock); \
-    AutoLock __al = {map, 1}; \
-    (void)__al
-#endif
+/* 引用计数非 0 时加一；已降为 0（等待回收）时返回 0 */
+static inline int structure_try_retain(Structure* st) {
+    int n = __atomic_load_n(&st->refcount, __ATOMIC_RELAXED);
+    while (n > 0)
+        if (__atomic_compare_exchange_n(&st->refcount, &n, n + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+static void structure_release(Structure* st);
 
-// ==================== 核心哈希表操作 ====================
-#if HAS_GNU_EXTENSIONS
-// 使用 GNU C 语句表达式实现的宏版本
-static pthread_once_t __g_struct_map_once = PTHREAD_ONCE_INIT;
-
-static void __struct_map_init(void) {
-    /* 实际初始化函数，只执行一次 */
-    StructMap* __map = (StructMap*) malloc(sizeof(StructMap));
-    if (__map) {
-        __map->size = 0;        // 占位，后面会通过宏设置
-        __map->count = 0;
-        __map->buckets = NULL;
-        pthread_rwlock_init(&__map->lock, NULL);
-        __g_struct_map = __map;
+/* 释放类型对结构体的引用（非结构体类型与可变参数标记忽略） */
+static inline void type_release(ffi_type* type) {
+    if (type && type != (ffi_type*)-1 && type->type == FFI_TYPE_STRUCT)
+        structure_release((Structure*)((char*)type - offsetof(Structure, type)));
+}
+
+static void structure_free(void* p) {
+    Structure* st = (Structure*)p;
+    if (st->elem) {
+        type_release(st->elem);                     // 数组：elements 中重复的元素类型只持有一个引用
+    } else if (st->type.elements) {
+        for (ffi_type** t = st->type.elements; *t; t++) type_release(*t);
     }
+    free(st->offsets);
+    free(st->name);
+    free(st->type.elements);
+    free(st->field_names);
+    free(st->field_slots);
+    free(st);
 }
 
-#define INIT_STRUCTMAP(sz) ({ \
-    pthread_once(&__g_struct_map_once, __struct_map_init); \
-    StructMap* __map = __g_struct_map; \
-    if (__map && (__map)->size == 0) { \
-        __map->buckets = calloc((sz), sizeof(Node*)); \
-        if (__map->buckets) { \
-            (__map)->size = (sz); \
-        } else { \
-            pthread_rwlock_destroy(&__map->lock); \
-            free(__map); \
-            __g_struct_map = NULL; \
-            __map = NULL; \
-        } \
-    } \
-    __map; \
-})
-
-#define STRUCTMAP_PUT(_key, _type) ({ \
-    int __result = 0; \
-    if (!__g_struct_map || !(_key)) { \
-        __result = -1; \
-    } else { \
-        WITH_WRITE_LOCK(__g_struct_map); \
-        size_t __idx = hash_str(_key) % __g_struct_map->size; \
-        Node* __curr = __g_struct_map->buckets[__idx]; \
-        Node* __prev = NULL; \
-        while (__curr) { \
-            if (strcmp(__curr->key, _key) == 0) { \
-                (__curr)->type = (_type); \
-                __result = 1; \
-                break; \
-            } \
-            __prev = __curr; \
-            __curr = __curr->next; \
-        } \
-        if (!__curr) { \
-            Node* __new = hash_node_create(_key, _type); \
-            if (__new) { \
-                if (__prev) __prev->next = __new; \
-                else __g_struct_map->buckets[__idx] = __new; \
-                ATOMIC_STORE(&__g_struct_map->count, __g_struct_map->count + 1); \
-                __result = 2; \
-            } else { \
-                __result = -2; \
-            } \
-        } \
-    } \
-    __result; \
-})
-
-#define STRUCTMAP_GET(_key) ({ \
-    Structure* __result = NULL; \
-    if (__g_struct_map && (_key)) { \
-        size_t __idx = hash_str(_key) % __g_struct_map->size; \
-        Node* __curr = __g_struct_map->buckets[__idx]; \
-        for (int __i = 0; __i < 3 && __curr; __i++) { \
-            if (strcmp(__curr->key, _key) == 0) { \
-                __result = &__curr->type; \
-                break; \
-            } \
-            __curr = __curr->next; \
-        } \
-        if (!__result) { \
-            WITH_READ_LOCK(__g_struct_map); \
-            __curr = __g_struct_map->buckets[__idx]; \
-            while (__curr) { \
-                if (strcmp(__curr->key, _key) == 0) { \
-                    __result = &__curr->type; \
-                    break; \
-                } \
-                __curr = __curr->next; \
-            } \
-        } \
-    } \
-    __result; \
-})
-
-#define STRUCTMAP_DEL(_key) ({ \
-    int __result = 0; \
-    if (__g_struct_map && (_key)) { \
-        WITH_WRITE_LOCK(__g_struct_map); \
-        size_t __idx = hash_str(_key) % __g_struct_map->size; \
-        Node* __curr = __g_struct_map->buckets[__idx]; \
-        Node* __prev = NULL; \
-        while (__curr) { \
-            if (strcmp(__curr->key, _key) == 0) { \
-                if (__prev) __prev->next = __curr->next; \
-                else __g_struct_map->buckets[__idx] = __curr->next; \
-                hash_node_free(__curr); \
-                ATOMIC_STORE(&__g_struct_map->count, __g_struct_map->count - 1); \
-                __result = 1; \
-                break; \
-            } \
-            __prev = __curr; \
-            __curr = __curr->next; \
-        } \
-    } \
-    __result; \
-})
-
-#define STRUCTMAP_DESTROY() do { \
-    if (__g_struct_map) { \
-        pthread_rwlock_wrlock(&__g_struct_map->lock); \
-        for (size_t __i = 0; __i < __g_struct_map->size; __i++) { \
-            Node* __curr = __g_struct_map->buckets[__i]; \
-            while (__curr) { \
-                Node* __tmp = __curr->next; \
-                hash_node_free(__curr); \
-                __curr = __tmp; \
-            } \
-        } \
-        free(__g_struct_map->buckets); \
-        pthread_rwlock_unlock(&__g_struct_map->lock); \
-        pthread_rwlock_destroy(&__g_struct_map->lock); \
-        free(__g_struct_map); \
-        __g_struct_map = NULL; \
-    } \
-} while(0)
-
-#define STRUCTMAP_COUNT() ({ \
-    size_t __result = 0; \
-    if (__g_struct_map) { \
-        __result = ATOMIC_LOAD(&__g_struct_map->count); \
-    } \
-    __result; \
-})
+static void structure_release(Structure* st) {
+    if (st && __atomic_sub_fetch(&st->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        epoch_retire(st, structure_free);          // 并发的查找可能仍在读取
+}
 
-#else
-// ==================== 非 GNU C 的内联函数版本 ====================
-static inline int init_structmap(size_t size) {
-    if (!__g_struct_map) return 1;
-    StructMap* map = (StructMap*) malloc(sizeof(StructMap));
-    if (!map) return 0;
-    
-    map->size = size;
-    map->count = 0;
-    map->buckets = calloc(size, sizeof(Node*));
-    if (!map->buckets) {
-        free(map);
-        return 0;
-    }
-    
-    pthread_rwlock_init(&map->lock, NULL);
-    __g_struct_map = map;
-    return map;
+// ==================== 开放寻址映射表 ====================
+/* 读者无锁：表指针与槽位均以 acquire 读取；写者互斥，扩容时发布新表并延迟回收旧表。 */
+#define STRUCTMAP_TOMBSTONE ((Structure*)1)
+
+typedef struct StructTable {
+    size_t mask;                // 容量 - 1
+    size_t used;                // 已占用槽位（含墓碑）
+    Structure* slots[];
+} StructTable;
+
+typedef struct {
+    StructTable* table;
+    size_t count;
+    pthread_mutex_t lock;       // 写者互斥
+} StructMap;
+
+// 全局哈希表实例
+static StructMap __g_struct_map = { NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static StructTable* struct_table_new(size_t capacity) {
+    StructTable* t = calloc(1, sizeof(StructTable) + capacity * sizeof(Structure*));
+    if (t) t->mask = capacity - 1;
+    return t;
 }
 
-static inline int structmap_put(const char* key, Structure type) {
-    if (!__g_struct_map || !key) return -1;
-    
-    pthread_rwlock_wrlock(&__g_struct_map->lock);
-    int result = 0;
-    size_t idx = hash_str(key) % __g_struct_map->size;
-    Node* curr = __g_struct_map->buckets[idx];
-    Node* prev = NULL;
-    
-    while (curr) {
-        if (strcmp(curr->key, key) == 0) {
-            curr->type = type;
-            result = 1;
-            break;
-        }
-        prev = curr;
-        curr = curr->next;
+static inline int structmap_init(size_t capacity) {
+    size_t cap = 16;
+    while (cap < capacity) cap <<= 1;
+    pthread_mutex_lock(&__g_struct_map.lock);
+    if (!__g_struct_map.table)
+        __atomic_store_n(&__g_struct_map.table, struct_table_new(cap), __ATOMIC_RELEASE);
+    int ok = __g_struct_map.table != NULL;
+    pthread_mutex_unlock(&__g_struct_map.lock);
+    return ok;
+}
+
+/* 在 t 中查找 key，返回槽位序号，未找到返回 -1（读者与写者共用） */
+static inline long struct_table_find(StructTable* t, const char* key, size_t len, size_t hash) {
+    for (size_t i = hash & t->mask; ; i = (i + 1) & t->mask) {
+        Structure* st = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+        if (!st) return -1;
+        if (st != STRUCTMAP_TOMBSTONE && st->hash == hash && st->name_len == len &&
+            memcmp(st->name, key, len) == 0)
+            return (long)i;
     }
-    
-    if (!curr) {
-        Node* new = hash_node_create(key, type);
-        if (new) {
-            if (prev) prev->next = new;
-            else __g_struct_map->buckets[idx] = new;
-            __g_struct_map->count++;
-            result = 2;
-        } else {
-            result = -2;
+}
+
+/* 查找并持有一个引用（调用方以 structure_release 释放），未注册返回 NULL */
+static inline Structure* structmap_acquire(const char* key, size_t len) {
+    size_t hash = hash_str_n(key, len);
+    Structure* result = NULL;
+    EpochRecord* r = epoch_enter();
+    StructTable* t = __atomic_load_n(&__g_struct_map.table, __ATOMIC_ACQUIRE);
+    if (t) {
+        long i = struct_table_find(t, key, len, hash);
+        if (i >= 0) {
+            Structure* st = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+            if (st != STRUCTMAP_TOMBSTONE && structure_try_retain(st)) result = st;
         }
     }
-    
-    pthread_rwlock_unlock(&__g_struct_map->lock);
+    epoch_exit(r);
     return result;
 }
 
-static inline Structure* structmap_get(const char* key) {
-    Structure* __result = NULL;
-    if (__g_struct_map && (key)) {
-        size_t __idx = hash_str(key) % __g_struct_map->size;
-        Node* __curr = __g_struct_map->buckets[__idx];
-        for (int __i = 0; __i < 3 && __curr; __i++) {
-            if (strcmp(__curr->key, key) == 0) {
-                __result = &__curr->type;
-                break;
-            }
-            __curr = __curr->next;
-        }
-        if (!__result) {
-            WITH_READ_LOCK(__g_struct_map);
-            __curr = __g_struct_map->buckets[__idx];
-            while (__curr) {
-                if (strcmp(__curr->key, key) == 0) {
-                    __result = &__curr->type;
-                    break;
-                }
-                __curr = __curr->next;
-            }
-        }
+/* 持有写锁时调用：按存活项个数重建表，发布后延迟回收旧表 */
+static int structmap_rehash_locked(size_t live) {
+    StructTable* old = __g_struct_map.table;
+    size_t cap = 16;
+    while (cap < live * 2) cap <<= 1;
+    StructTable* t = struct_table_new(cap);
+    if (!t) return 0;
+    for (size_t i = 0; i <= old->mask; i++) {
+        Structure* st = old->slots[i];
+        if (!st || st == STRUCTMAP_TOMBSTONE) continue;
+        size_t j = st->hash & t->mask;
+        while (t->slots[j]) j = (j + 1) & t->mask;
+        t->slots[j] = st;
+        t->used++;
     }
-    return __result;
+    __atomic_store_n(&__g_struct_map.table, t, __ATOMIC_RELEASE);
+    epoch_retire(old, free);
+    return 1;
 }
 
-static inline int structmap_del(const char* key) {
-    int __result = 0;
-    if (__g_struct_map && (key)) {
-        WITH_WRITE_LOCK(__g_struct_map);
-        size_t __idx = hash_str(key) % __g_struct_map->size;
-        Node* __curr = __g_struct_map->buckets[__idx];
-        Node* __prev = NULL;
-        while (__curr) {
-            if (strcmp(__curr->key, key) == 0) {
-                if (__prev) __prev->next = __curr->next;
-                else __g_struct_map->buckets[__idx] = __curr->next;
-                hash_node_free(__curr);
-                ATOMIC_STORE(&__g_struct_map->count, __g_struct_map->count - 1);
-                __result = 1;
-                break;
-            }
-            __prev = __curr;
-            __curr = __curr->next;
+/* 注册 st（其一个引用转交映射表），同名结构体被替换，映射表对旧结构体的引用随之释放。
+ * 返回 1 替换，2 新增，负数失败（失败时引用仍归调用方） */
+static inline int structmap_put(Structure* st) {
+    size_t len = strlen(st->name);
+    st->name_len = len;
+    st->hash = hash_str_n(st->name, len);
+    pthread_mutex_lock(&__g_struct_map.lock);
+    StructTable* t = __g_struct_map.table;
+    if (!t) {
+        pthread_mutex_unlock(&__g_struct_map.lock);
+        return -1;
+    }
+    long found = struct_table_find(t, st->name, len, st->hash);
+    if (found >= 0) {
+        Structure* old = t->slots[found];
+        __atomic_store_n(&t->slots[found], st, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&__g_struct_map.lock);
+        structure_release(old);
+        return 1;
+    }
+    /* 占用（含墓碑）超过 3/4 时重建，墓碑在重建时清除 */
+    if ((t->used + 1) * 4 > (t->mask + 1) * 3) {
+        if (!structmap_rehash_locked(__g_struct_map.count + 1)) {
+            pthread_mutex_unlock(&__g_struct_map.lock);
+            return -2;
         }
+        t = __g_struct_map.table;
     }
-    return __result;
+    size_t i = st->hash & t->mask;
+    while (t->slots[i] && t->slots[i] != STRUCTMAP_TOMBSTONE) i = (i + 1) & t->mask;
+    if (!t->slots[i]) t->used++;
+    __atomic_store_n(&t->slots[i], st, __ATOMIC_RELEASE);
+    __atomic_store_n(&__g_struct_map.count, __g_struct_map.count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&__g_struct_map.lock);
+    return 2;
 }
 
-static inline void structmap_destroy() {
-    if (!__g_struct_map) 
-        return;
-    pthread_rwlock_wrlock(&__g_struct_map->lock);
-    for (size_t __i = 0; __i < __g_struct_map->size; __i++) {
-        Node* __curr = __g_struct_map->buckets[__i];
-        while (__curr) {
-            Node* __tmp = __curr->next;
-            hash_node_free(__curr);
-            __curr = __tmp;
-        }
+/* 注销：槽位置为墓碑；已持有引用的签名、视图等继续有效 */
+static inline int structmap_del(const char* key) {
+    size_t len = strlen(key);
+    pthread_mutex_lock(&__g_struct_map.lock);
+    StructTable* t = __g_struct_map.table;
+    long found = t ? struct_table_find(t, key, len, hash_str_n(key, len)) : -1;
+    Structure* old = NULL;
+    if (found >= 0) {
+        old = t->slots[found];
+        __atomic_store_n(&t->slots[found], STRUCTMAP_TOMBSTONE, __ATOMIC_RELEASE);
+        __atomic_store_n(&__g_struct_map.count, __g_struct_map.count - 1, __ATOMIC_RELEASE);
     }
-    free(__g_struct_map->buckets);
-    pthread_rwlock_unlock(&__g_struct_map->lock);
-    pthread_rwlock_destroy(&__g_struct_map->lock);
-    free(__g_struct_map);
-    __g_struct_map = NULL;
+    pthread_mutex_unlock(&__g_struct_map.lock);
+    structure_release(old);
+    return found >= 0;
 }
 
-size_t structmap_count() {
-    size_t __result = 0;
-    if (__g_struct_map) {
-        __result = ATOMIC_LOAD(&__g_struct_map->count);
-    }
-    return __result;
+static inline size_t structmap_count(void) {
+    return __atomic_load_n(&__g_struct_map.count, __ATOMIC_ACQUIRE);
 }
 
-#define INIT_STRUCTMAP(size) init_structmap(size)
-#define STRUCTMAP_PUT(key, type) structmap_put(key, type)
-#define STRUCTMAP_GET(key) structmap_get(key)
+#define INIT_STRUCTMAP(size) structmap_init(size)
+#define STRUCTMAP_PUT(st) structmap_put(st)
+#define STRUCTMAP_ACQUIRE(key) structmap_acquire((key), strlen(key))
 #define STRUCTMAP_DEL(key) structmap_del(key)
-#define STRUCTMAP_DESTROY() structmap_destroy()
 #define STRUCTMAP_COUNT() structmap_count()
-
-#endif // HAS_GNU_EXTENSIONS
@@ -0,0 +1,113 @@
+#ifndef LUAFFI_THREADPOOL_H
+#define LUAFFI_THREADPOOL_H
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* ---------- 工作线程池（惰性创建，线程数等于 CPU 核数） ----------
+ * 并行 map/reduce 使用计算线程池 __g_pool；异步调用可能长时间阻塞，使用独立的 __g_async_pool，
+ * 两者互不占用线程 */
+typedef void (*TaskFunc)(void* arg);
+
+typedef struct Task {
+    TaskFunc fn;
+    void* arg;
+    struct Task* next;
+} Task;
+
+typedef struct ThreadPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Task* head;
+    Task* tail;
+    int nthreads;
+    int started;
+} ThreadPool;
+
+static ThreadPool __g_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+static ThreadPool __g_async_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static void* pool_worker(void* arg) {
+    ThreadPool* pool = (ThreadPool*)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        Task* t = pool->head;
+        pool->head = t->next;
+        if (!pool->head) pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        t->fn(t->arg);
+        free(t);
+    }
+    return NULL;
+}
+
+/* 线程池中的线程数（首次调用时创建线程池） */
+static inline int pool_size(ThreadPool* pool) {
+    if (__atomic_load_n(&pool->started, __ATOMIC_ACQUIRE)) return pool->nthreads;
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->started) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpu < 1) ncpu = 1;
+        for (long i = 0; i < ncpu; i++) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, pool_worker, pool) == 0) {
+                pthread_detach(tid);
+                pool->nthreads++;
+            }
+        }
+        __atomic_store_n(&pool->started, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pool->nthreads;
+}
+
+/* 提交任务，成功返回 1 */
+static inline int pool_submit(ThreadPool* pool, TaskFunc fn, void* arg) {
+    if (pool_size(pool) == 0) return 0;
+    Task* t = malloc(sizeof(Task));
+    if (!t) return 0;
+    t->fn = fn;
+    t->arg = arg;
+    t->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) pool->tail->next = t;
+    else pool->head = t;
+    pool->tail = t;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+/* 撤回尚未开始执行的 (fn, arg) 任务，返回撤回的个数 */
+static inline int pool_cancel(ThreadPool* pool, TaskFunc fn, void* arg) {
+    int n = 0;
+    pthread_mutex_lock(&pool->lock);
+    Task** link = &pool->head;
+    Task* prev = NULL;
+    while (*link) {
+        Task* t = *link;
+        if (t->fn == fn && t->arg == arg) {
+            *link = t->next;
+            free(t);
+            n++;
+        } else {
+            prev = t;
+            link = &t->next;
+        }
+    }
+    pool->tail = prev;
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+#endif
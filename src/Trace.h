@@ -0,0 +1,152 @@
+#ifndef LUAFFI_TRACE_H
+#define LUAFFI_TRACE_H
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* ---------- 调用追踪（LuaFFI.traceStart 开启）：每线程一个环形缓冲区 ----------
+ * 只有所属线程写入自己的环，写完事件后以 release 语义推进 head；导出时按 head
+ * 拷贝并丢弃拷贝期间被覆盖的事件，写入路径无锁。 */
+#define TRACE_RING_BITS 14
+#define TRACE_RING_SIZE (1u << TRACE_RING_BITS)
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+enum { TRACE_NATIVE, TRACE_LUA, TRACE_LUA_MT };
+
+typedef struct TraceEvent {
+    uint64_t    ts;             // 时间戳（CLOCK_MONOTONIC，纳秒）
+    const void* id;             // 绑定标识（NativeFunction / 闭包信息的地址）
+    int         tid;            // 线程（环可能被先后多个线程使用）
+    int         phase;          // 'B' 进入，'E' 退出
+} TraceEvent;
+
+typedef struct TraceRing {
+    uint64_t    head;           // 已写入的事件总数（原子读写）
+    uint64_t    base;           // 本次追踪开始时的 head，之前的事件不导出
+    int         alive;          // 线程退出后为 0，可被新线程复用
+    struct TraceRing* next;
+    TraceEvent  ev[TRACE_RING_SIZE];
+} TraceRing;
+
+/* 绑定标识到名字的映射，每个绑定在一次追踪中首次产生事件时登记 */
+typedef struct TraceName {
+    const void* id;
+    int         kind;           // TRACE_*
+    unsigned    seq;            // 登记顺序，同一地址被复用时以最新的为准
+    char*       name;
+    struct TraceName* next;
+} TraceName;
+
+static int __g_trace_enabled = 0;
+static unsigned __g_trace_epoch = 1;        // 每次 traceStart 递增，使各绑定重新登记名字
+static uint64_t __g_trace_start = 0;
+static TraceRing* __g_trace_rings = NULL;
+static TraceName* __g_trace_names = NULL;
+static unsigned __g_trace_seq = 0;
+static pthread_mutex_t __g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t __g_trace_key;
+static pthread_once_t __g_trace_once = PTHREAD_ONCE_INIT;
+static __thread TraceRing* __t_trace_ring = NULL;
+static __thread int __t_trace_tid = 0;
+
+static inline int trace_enabled(void) {
+    return __builtin_expect(__atomic_load_n(&__g_trace_enabled, __ATOMIC_RELAXED), 0);
+}
+
+static inline uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void trace_thread_exit(void* p) {
+    __atomic_store_n(&((TraceRing*)p)->alive, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_key_init(void) {
+    pthread_key_create(&__g_trace_key, trace_thread_exit);
+}
+
+static int trace_tid(void) {
+#ifdef __linux__
+    return (int)syscall(SYS_gettid);
+#else
+    static int next = 0;
+    return __atomic_add_fetch(&next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/* 当前线程的环（首次使用时接续已退出线程的环或新建），失败返回 NULL */
+static TraceRing* trace_ring(void) {
+    if (__t_trace_ring) return __t_trace_ring;
+    pthread_once(&__g_trace_once, trace_key_init);
+    pthread_mutex_lock(&__g_trace_lock);
+    TraceRing* r = __g_trace_rings;
+    while (r && __atomic_load_n(&r->alive, __ATOMIC_ACQUIRE)) r = r->next;
+    if (!r && (r = calloc(1, sizeof(TraceRing)))) {
+        r->next = __g_trace_rings;
+        __g_trace_rings = r;
+    }
+    if (r) r->alive = 1;        // 复用时在原有事件之后继续写入
+    pthread_mutex_unlock(&__g_trace_lock);
+    __t_trace_tid = trace_tid();
+    if (r) pthread_setspecific(__g_trace_key, r);
+    return __t_trace_ring = r;
+}
+
+static inline void trace_emit(const void* id, int phase) {
+    TraceRing* r = trace_ring();
+    if (!r) return;
+    uint64_t h = r->head;
+    TraceEvent* e = &r->ev[h & TRACE_RING_MASK];
+    e->ts = trace_now();
+    e->id = id;
+    e->tid = __t_trace_tid;
+    e->phase = phase;
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+/* 该绑定在本次追踪中是否已登记名字 */
+static inline int trace_named(const unsigned* epoch) {
+    return __atomic_load_n(epoch, __ATOMIC_ACQUIRE) == __atomic_load_n(&__g_trace_epoch, __ATOMIC_RELAXED);
+}
+
+static void trace_register(const void* id, unsigned* epoch, int kind, const char* name) {
+    TraceName* n = malloc(sizeof(TraceName));
+    if (!n) return;
+    n->name = strdup(name);
+    if (!n->name) { free(n); return; }
+    n->id = id;
+    n->kind = kind;
+    pthread_mutex_lock(&__g_trace_lock);
+    n->seq = ++__g_trace_seq;
+    n->next = __g_trace_names;
+    __g_trace_names = n;
+    __atomic_store_n(epoch, __g_trace_epoch, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&__g_trace_lock);
+}
+
+/* 开始新的追踪：清空名字表，各环从当前位置重新计数（写入线程不受影响） */
+static void trace_reset(void) {
+    pthread_mutex_lock(&__g_trace_lock);
+    while (__g_trace_names) {
+        TraceName* next = __g_trace_names->next;
+        free(__g_trace_names->name);
+        free(__g_trace_names);
+        __g_trace_names = next;
+    }
+    for (TraceRing* r = __g_trace_rings; r; r = r->next)
+        r->base = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    __g_trace_epoch++;
+    if (__g_trace_epoch == 0) __g_trace_epoch = 1;  // 0 表示从未登记
+    __g_trace_start = trace_now();
+    pthread_mutex_unlock(&__g_trace_lock);
+}
+
+#endif